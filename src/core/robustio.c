@@ -9,6 +9,7 @@
 
 #include "robustio.h"
 #include "robustsession.h"
+#include "robustsession-lag.h"
 
 static GIOStatus robust_io_read(GIOChannel *channel,
                                 gchar *buf,
@@ -60,6 +61,7 @@ GIOChannel *robust_io_channel_new(SERVER_REC *server) {
     channel = g_new0(RobustIOChannel, 1);
     iochannel = (GIOChannel *)channel;
 
+    channel->fd = -1;
     channel->server = server;
 
     iochannel->is_readable = FALSE;
@@ -96,9 +98,11 @@ static GIOStatus robust_io_write(GIOChannel *channel,
                                  GError **err) {
     (void)err;
     RobustIOChannel *robust_channel = (RobustIOChannel *)channel;
+    const gint64 start = robustsession_lag_enter();
 
     robustsession_send(robust_channel->robustsession, robust_channel->server, buf, count);
     *bytes_written = count;
+    robustsession_lag_leave("robust_io_write", start);
 
     return G_IO_STATUS_NORMAL;
 }
@@ -106,7 +110,9 @@ static GIOStatus robust_io_write(GIOChannel *channel,
 static GIOStatus robust_io_close(GIOChannel *channel, GError **err) {
     (void)err;
     RobustIOChannel *robust_channel = (RobustIOChannel *)channel;
-    robustsession_destroy(robust_channel->robustsession);
+    if (robust_channel->robustsession != NULL) {
+        robustsession_destroy(robust_channel->robustsession);
+    }
     return G_IO_STATUS_NORMAL;
 }
 
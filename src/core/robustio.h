@@ -4,6 +4,9 @@ typedef struct _RobustIOChannel RobustIOChannel;
 
 struct _RobustIOChannel {
     GIOChannel channel;
+    // Laid out like GIOUnixChannel because irssi’s /upgrade calls
+    // g_io_channel_unix_get_fd() on every server handle. Always -1.
+    gint fd;
     SERVER_REC *server;
     struct t_robustsession_ctx *robustsession;
 };
@@ -2,6 +2,7 @@
 // © 2015 Michael Stapelberg (see COPYING)
 
 #include <assert.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "modules.h"
@@ -21,6 +22,7 @@
 #include "net-sendbuffer.h"
 #include "printtext.h"
 #include "levels.h"
+#include "lib-config/iconfig.h"
 
 #include "robustirc.h"
 #include "robustio.h"
@@ -55,9 +57,26 @@ SERVER_REC *robustirc_server_init_connect(SERVER_CONNECT_REC *connrec) {
 
     connrec->chat_type = IRC_PROTOCOL;
     server = irc_server_init_connect(connrec);
+    if (settings_get_bool("robustirc_pacing")) {
+        // robustsession_send() paces lines according to what the RobustIRC
+        // network accepts, so irssi’s anti-flood queue (cmd_queue_speed,
+        // tuned for TCP IRC servers) would only add delay on top.
+        IRC_SERVER_REC *ircserver = IRC_SERVER(server);
+        ircserver->max_cmds_at_once = G_MAXINT / 2;
+        ircserver->cmd_queue_speed = 0;
+    }
     GIOChannel *handle = robust_io_channel_new(server);
     RobustIOChannel *io = (RobustIOChannel *)handle;
-    io->robustsession = robustsession_connect(server);
+    if (connrec->connect_handle != NULL) {
+        // Restored by /upgrade. The handle is only a placeholder for stdin
+        // (see robustirc_session_save_server), so it must not be shut down
+        // (which would close stdin), only released. The session is resumed
+        // in robustirc_session_restore_server.
+        g_io_channel_unref(connrec->connect_handle);
+        connrec->connect_handle = NULL;
+    } else {
+        io->robustsession = robustsession_connect(server);
+    }
     server->handle = net_sendbuffer_create(handle, 0);
     // TODO: how many of these are necessary?
     server->connrec->no_connect = TRUE;
@@ -96,7 +115,10 @@ static void robustirc_server_connect_copy(SERVER_CONNECT_REC **dest, IRC_SERVER_
 
 static void robustirc_server_disconnected(SERVER_REC *server) {
     g_return_if_fail(server != NULL);
-    g_return_if_fail(server->handle != NULL);
+    if (server->handle == NULL) {
+        // /upgrade already took the handle away from this server.
+        return;
+    }
     g_return_if_fail(server->handle->handle != NULL);
     if (!robust_io_is_robustio_channel(server->handle->handle)) {
         printtext(NULL, NULL, MSGLEVEL_CRAP, "disconnect from server, but not a robustio channel");
@@ -107,11 +129,53 @@ static void robustirc_server_disconnected(SERVER_REC *server) {
     robustsession_write_only(io->robustsession);
 }
 
+static void robustirc_session_save_server(SERVER_REC *server, CONFIG_REC *config, CONFIG_NODE *node) {
+    if (server->handle == NULL ||
+        !robust_io_is_robustio_channel(server->handle->handle)) {
+        return;
+    }
+    RobustIOChannel *io = (RobustIOChannel *)server->handle->handle;
+    if (io->robustsession == NULL) {
+        return;
+    }
+
+    // irssi only restores servers with a valid "handle" (the socket which
+    // survives the exec()), but a RobustIRC session is not tied to any socket.
+    // Hence, store stdin as a placeholder, which always exists in the next
+    // irssi process, see robustirc_server_init_connect().
+    config_node_set_int(config, node, "handle", STDIN_FILENO);
+    // chat_type is IRC_PROTOCOL, see robustirc_server_init_connect.
+    config_node_set_str(config, node, "chat_type", ROBUSTIRC_PROTOCOL_NAME);
+    robustsession_save(io->robustsession, config, node);
+}
+
+static void robustirc_session_restore_server(SERVER_REC *server, CONFIG_NODE *node) {
+    if (server->handle == NULL ||
+        !robust_io_is_robustio_channel(server->handle->handle)) {
+        return;
+    }
+    RobustIOChannel *io = (RobustIOChannel *)server->handle->handle;
+    io->robustsession = robustsession_restore(server, node);
+    if (io->robustsession == NULL) {
+        // The previous irssi process had not created a session yet.
+        server->session_reconnect = FALSE;
+        io->robustsession = robustsession_connect(server);
+    }
+}
+
 void robustirc_server_connect(IRC_SERVER_REC *server) {
     if (!IS_IRC_SERVER(server)) {
         return;
     }
 
+    if (server->session_reconnect) {
+        // Restored by /upgrade: the RobustIRC session is still registered, so
+        // there is nothing to wait for.
+        server->connect_tag = -1;
+        server_connect_finished(SERVER(server));
+        return;
+    }
+
     gchar *m = g_strdup_printf("server = %p, server->connrec = %p", server, server->connrec);
     printtext(NULL, NULL, MSGLEVEL_CRAP, "connect. server = %s", m);
     g_free(m);
@@ -139,6 +203,70 @@ QUERY_REC *query_create(const char *server_tag,
     return rec;
 }
 
+static void cmd_robustirc(const char *data, SERVER_REC *server, void *item) {
+    command_runsub("robustirc", data, server, item);
+}
+
+/* SYNTAX: ROBUSTIRC STATS */
+static void cmd_robustirc_stats(const char *data, SERVER_REC *server, void *item) {
+    (void)data;
+    (void)server;
+    (void)item;
+    robustsession_print_stats();
+}
+
+/* SYNTAX: ROBUSTIRC DRAIN <network> <target> */
+static void cmd_robustirc_drain(const char *data, SERVER_REC *server, void *item) {
+    char *network, *target;
+    void *free_arg;
+    (void)server;
+    (void)item;
+    if (!cmd_get_params(data, &free_arg, 2, &network, &target)) {
+        return;
+    }
+    if (*network == '\0' || *target == '\0') {
+        cmd_params_free(free_arg);
+        cmd_return_error(CMDERR_NOT_ENOUGH_PARAMS);
+    }
+    robustsession_drain(network, target, true);
+    cmd_params_free(free_arg);
+}
+
+/* SYNTAX: ROBUSTIRC UNDRAIN <network> <target> */
+static void cmd_robustirc_undrain(const char *data, SERVER_REC *server, void *item) {
+    char *network, *target;
+    void *free_arg;
+    (void)server;
+    (void)item;
+    if (!cmd_get_params(data, &free_arg, 2, &network, &target)) {
+        return;
+    }
+    if (*network == '\0' || *target == '\0') {
+        cmd_params_free(free_arg);
+        cmd_return_error(CMDERR_NOT_ENOUGH_PARAMS);
+    }
+    robustsession_drain(network, target, false);
+    cmd_params_free(free_arg);
+}
+
+/* SYNTAX: ROBUSTIRC PIN <network> [<target>] */
+static void cmd_robustirc_pin(const char *data, SERVER_REC *server, void *item) {
+    char *network, *target;
+    void *free_arg;
+    (void)server;
+    (void)item;
+    if (!cmd_get_params(data, &free_arg, 2, &network, &target)) {
+        return;
+    }
+    if (*network == '\0') {
+        cmd_params_free(free_arg);
+        cmd_return_error(CMDERR_NOT_ENOUGH_PARAMS);
+    }
+    // Without a target, the network is unpinned.
+    robustsession_pin(network, (*target != '\0' ? target : NULL));
+    cmd_params_free(free_arg);
+}
+
 #ifdef IRSSI_ABI_VERSION
 void robustirc_core_abicheck(int *version) {
     *version = IRSSI_ABI_VERSION;
@@ -172,6 +300,31 @@ void robustirc_core_init(void) {
 
     signal_add_last("server connect copy", (SIGNAL_FUNC)robustirc_server_connect_copy);
     signal_add_last("server disconnected", (SIGNAL_FUNC)robustirc_server_disconnected);
+    signal_add("session save server", (SIGNAL_FUNC)robustirc_session_save_server);
+    signal_add("session restore server", (SIGNAL_FUNC)robustirc_session_restore_server);
+
+    settings_add_bool("robustirc", "robustirc_fast_recovery", TRUE);
+    settings_add_int("robustirc", "robustirc_recovery_attempts", 5);
+    settings_add_time("robustirc", "robustirc_shutdown_timeout", "2s");
+    settings_add_str("robustirc", "robustirc_placement", "colocate");
+    settings_add_time("robustirc", "robustirc_probe_interval", "1min");
+    settings_add_str("robustirc", "robustirc_shared_health", "");
+    settings_add_str("robustirc", "robustirc_tap", "");
+    settings_add_size("robustirc", "robustirc_tap_size", "1M");
+    settings_add_str("robustirc", "robustirc_filter", "");
+    settings_add_int("robustirc", "robustirc_parse_threads", 0);
+    settings_add_str("robustirc", "robustirc_io_backend", "glib");
+    settings_add_time("robustirc", "robustirc_lag_warning", "100ms");
+    settings_add_time("robustirc", "robustirc_coalesce_max", "20ms");
+    settings_add_bool("robustirc", "robustirc_pacing", TRUE);
+    settings_add_int("robustirc", "robustirc_send_rate", 0);
+    settings_add_time("robustirc", "robustirc_stream_lifetime", "0");
+
+    command_bind("robustirc", NULL, (SIGNAL_FUNC)cmd_robustirc);
+    command_bind("robustirc stats", NULL, (SIGNAL_FUNC)cmd_robustirc_stats);
+    command_bind("robustirc drain", NULL, (SIGNAL_FUNC)cmd_robustirc_drain);
+    command_bind("robustirc undrain", NULL, (SIGNAL_FUNC)cmd_robustirc_undrain);
+    command_bind("robustirc pin", NULL, (SIGNAL_FUNC)cmd_robustirc_pin);
 
     connrecs = g_hash_table_new(NULL, NULL);
 
@@ -181,6 +334,26 @@ void robustirc_core_init(void) {
 }
 
 void robustirc_core_deinit(void) {
+    // Disconnect all RobustIRC servers right away: their handles refer to code
+    // which is about to be unloaded, so irssi must not close them lazily.
+    for (GSList *s = servers; s != NULL;) {
+        SERVER_REC *server = s->data;
+        s = s->next;
+        if (server->handle == NULL ||
+            !robust_io_is_robustio_channel(server->handle->handle)) {
+            continue;
+        }
+        server->connection_lost = TRUE;
+        server->no_reconnect = TRUE;
+        server_disconnect(server);
+    }
+
+    command_unbind("robustirc", (SIGNAL_FUNC)cmd_robustirc);
+    command_unbind("robustirc stats", (SIGNAL_FUNC)cmd_robustirc_stats);
+    command_unbind("robustirc drain", (SIGNAL_FUNC)cmd_robustirc_drain);
+    command_unbind("robustirc undrain", (SIGNAL_FUNC)cmd_robustirc_undrain);
+    command_unbind("robustirc pin", (SIGNAL_FUNC)cmd_robustirc_pin);
+
     robustsession_deinit();
 
     g_hash_table_destroy(connrecs);
@@ -0,0 +1,304 @@
+// vim:ts=4:sw=4:et
+// © 2015 Michael Stapelberg (see COPYING)
+
+// Drops or hides incoming messages which match one of the rules in
+// robustirc_filter, e.g. JOIN/PART/QUIT noise in large channels.
+//
+// Rules are separated by “;”, and a message matches a rule if it matches all
+// of the rule’s space-separated terms:
+//   JOIN          command (case-insensitive)
+//   #channel      first parameter, i.e. the channel of JOIN, PART, PRIVMSG, …
+//                 QUIT and NICK concern no channel, so rules with a channel
+//                 never match them.
+//   *!*@*.example nick!user@host mask of the sender (wildcards allowed)
+//
+// Example: /set robustirc_filter JOIN #big; PART #big; QUIT *!*@gateway/*
+//
+// The rules are compiled into a hash table keyed by command, so each message
+// is tokenized once and only compared against the rules for its command.
+//
+// Only PRIVMSG and NOTICE are dropped before irssi parses them. Commands which
+// change irssi’s channel state (e.g. other users joining or changing their
+// nick) still reach irssi, which updates its nicklists, but the message which
+// it would print is suppressed. Messages from or to our own nick are always
+// passed unchanged, and other commands are not filtered.
+
+// stdlib includes
+#include <stdbool.h>
+#include <string.h>
+
+// external library includes
+#include <glib.h>
+
+// irssi includes
+#include "common.h"
+#include "misc.h"
+#include "levels.h"
+#include "printtext.h"
+#include "settings.h"
+
+#include "signals.h"
+
+// module includes
+#include "robustirc.h"
+#include "module-formats.h"
+#include "robustsession-filter.h"
+
+struct filter_rule {
+    gchar *text;
+    // NULL if the rule does not restrict the respective field.
+    gchar *channel;
+    gchar *mask;
+    guint64 dropped;
+    guint64 hidden;
+};
+
+// The value of robustirc_filter which |rules| was compiled from.
+static gchar *filter_source;
+// All rules, in configuration order.
+static GPtrArray *rules;
+// Hash table, keyed by uppercase command, holding a GPtrArray of the rules
+// for that command. Rules without a command are stored under "".
+static GHashTable *by_command;
+
+// Commands which are handed to irssi but not printed when they match, see
+// filter_hidden(), and the irssi signals which print them.
+static const char *hidden_commands[] = {
+    "JOIN", "PART", "QUIT", "NICK", "KICK", "MODE", "TOPIC",
+};
+static const char *hidden_signals[] = {
+    "message join", "message part", "message quit", "message nick",
+    "message kick", "message irc mode", "message topic",
+};
+
+// Set while a message which should not be printed is handed to irssi.
+static bool hiding;
+
+static void filter_hidden(void) {
+    if (hiding) {
+        signal_stop();
+    }
+}
+
+static void rule_free(gpointer data) {
+    struct filter_rule *rule = data;
+    g_free(rule->text);
+    g_free(rule->channel);
+    g_free(rule->mask);
+    g_free(rule);
+}
+
+static void filter_clear(void) {
+    if (by_command != NULL) {
+        g_hash_table_destroy(by_command);
+        by_command = NULL;
+    }
+    if (rules != NULL) {
+        g_ptr_array_free(rules, TRUE);
+        rules = NULL;
+    }
+    g_free(filter_source);
+    filter_source = NULL;
+}
+
+static void filter_add(const char *command, struct filter_rule *rule) {
+    GPtrArray *list = g_hash_table_lookup(by_command, command);
+    if (list == NULL) {
+        list = g_ptr_array_new();
+        g_hash_table_insert(by_command, g_strdup(command), list);
+    }
+    g_ptr_array_add(list, rule);
+}
+
+static void filter_compile(const char *source) {
+    filter_clear();
+    filter_source = g_strdup(source);
+    rules = g_ptr_array_new_with_free_func(rule_free);
+    by_command = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)g_ptr_array_unref);
+
+    gchar **texts = g_strsplit(source, ";", -1);
+    for (gchar **t = texts; *t; t++) {
+        gchar *text = g_strstrip(*t);
+        if (*text == '\0') {
+            continue;
+        }
+        struct filter_rule *rule = g_new0(struct filter_rule, 1);
+        rule->text = g_strdup(text);
+        GPtrArray *commands = g_ptr_array_new_with_free_func(g_free);
+        gchar **terms = g_strsplit(text, " ", -1);
+        for (gchar **term = terms; *term; term++) {
+            if (**term == '\0') {
+                continue;
+            }
+            if (strchr("#&!+", **term) != NULL && strchr(*term, '@') == NULL) {
+                g_free(rule->channel);
+                rule->channel = g_ascii_strdown(*term, -1);
+            } else if (strchr(*term, '!') != NULL || strchr(*term, '@') != NULL) {
+                g_free(rule->mask);
+                rule->mask = g_strdup(*term);
+            } else {
+                g_ptr_array_add(commands, g_ascii_strup(*term, -1));
+            }
+        }
+        g_strfreev(terms);
+
+        g_ptr_array_add(rules, rule);
+        if (commands->len == 0) {
+            filter_add("", rule);
+        }
+        for (guint i = 0; i < commands->len; i++) {
+            filter_add(g_ptr_array_index(commands, i), rule);
+        }
+        g_ptr_array_free(commands, TRUE);
+    }
+    g_strfreev(texts);
+}
+
+// Copies the token starting at |*p| (up to the next space) into |buf| and
+// advances |*p| to the next token.
+static void next_token(const char **p, char *buf, size_t size) {
+    const size_t len = strcspn(*p, " \r\n");
+    const size_t n = MIN(len, size - 1);
+    memcpy(buf, *p, n);
+    buf[n] = '\0';
+    *p += len;
+    while (**p == ' ') {
+        (*p)++;
+    }
+}
+
+// |param| is NULL for commands which concern no channel.
+static bool rule_matches(struct filter_rule *rule, const char *prefix, const char *param) {
+    if (rule->channel != NULL && (param == NULL || strcmp(rule->channel, param) != 0)) {
+        return false;
+    }
+    if (rule->mask != NULL && (*prefix == '\0' || !match_wildcard(rule->mask, prefix))) {
+        return false;
+    }
+    return true;
+}
+
+static bool list_matches(GPtrArray *list, const char *prefix, const char *param,
+                         robustsession_filter_action action) {
+    for (guint i = 0; list != NULL && i < list->len; i++) {
+        struct filter_rule *rule = g_ptr_array_index(list, i);
+        if (rule_matches(rule, prefix, param)) {
+            if (action == ROBUSTSESSION_FILTER_DROP) {
+                rule->dropped++;
+            } else {
+                rule->hidden++;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_own_nick(SERVER_REC *server, const char *nick, size_t len) {
+    return (server->nick != NULL &&
+            strlen(server->nick) == len &&
+            g_ascii_strncasecmp(server->nick, nick, len) == 0);
+}
+
+void robustsession_filter_init(void) {
+    for (size_t i = 0; i < G_N_ELEMENTS(hidden_signals); i++) {
+        signal_add_first(hidden_signals[i], (SIGNAL_FUNC)filter_hidden);
+    }
+}
+
+void robustsession_filter_deinit(void) {
+    for (size_t i = 0; i < G_N_ELEMENTS(hidden_signals); i++) {
+        signal_remove(hidden_signals[i], (SIGNAL_FUNC)filter_hidden);
+    }
+    filter_clear();
+}
+
+// Suppresses the printing of the messages which irssi processes until
+// robustsession_filter_hide(false) is called, see
+// ROBUSTSESSION_FILTER_HIDE.
+void robustsession_filter_hide(bool hide) {
+    hiding = hide;
+}
+
+// Returns what to do with |line|, received for |server|.
+robustsession_filter_action robustsession_filter_match(SERVER_REC *server, const char *line) {
+    const char *source = settings_get_str("robustirc_filter");
+    if (source == NULL || *source == '\0') {
+        if (filter_source != NULL) {
+            filter_clear();
+        }
+        return ROBUSTSESSION_FILTER_PASS;
+    }
+    if (filter_source == NULL || strcmp(filter_source, source) != 0) {
+        filter_compile(source);
+    }
+    if (rules->len == 0) {
+        return ROBUSTSESSION_FILTER_PASS;
+    }
+
+    char prefix[512] = "";
+    char command[32] = "";
+    char param[256] = "";
+    char param2[256] = "";
+    const char *p = line;
+    if (*p == ':') {
+        p++;
+        next_token(&p, prefix, sizeof(prefix));
+        if (is_own_nick(server, prefix, strcspn(prefix, "!@"))) {
+            return ROBUSTSESSION_FILTER_PASS;
+        }
+    }
+    next_token(&p, command, sizeof(command));
+    for (char *c = command; *c; c++) {
+        *c = g_ascii_toupper(*c);
+    }
+    robustsession_filter_action action = ROBUSTSESSION_FILTER_PASS;
+    if (strcmp(command, "PRIVMSG") == 0 || strcmp(command, "NOTICE") == 0) {
+        action = ROBUSTSESSION_FILTER_DROP;
+    }
+    for (size_t i = 0; i < G_N_ELEMENTS(hidden_commands); i++) {
+        if (strcmp(command, hidden_commands[i]) == 0) {
+            action = ROBUSTSESSION_FILTER_HIDE;
+        }
+    }
+    if (action == ROBUSTSESSION_FILTER_PASS) {
+        return action;
+    }
+    next_token(&p, param, sizeof(param));
+    next_token(&p, param2, sizeof(param2));
+    const char *channel = (*param == ':' ? param + 1 : param);
+    // E.g. a private message to us, or a KICK of us.
+    if (is_own_nick(server, channel, strlen(channel)) ||
+        (strcmp(command, "KICK") == 0 && is_own_nick(server, param2, strlen(param2)))) {
+        return ROBUSTSESSION_FILTER_PASS;
+    }
+    for (char *c = param; *c; c++) {
+        *c = g_ascii_tolower(*c);
+    }
+    // The parameter of QUIT is the quit message, and the one of NICK is the
+    // new nick.
+    if (strcmp(command, "QUIT") == 0 || strcmp(command, "NICK") == 0) {
+        channel = NULL;
+    }
+
+    if (list_matches(g_hash_table_lookup(by_command, command), prefix, channel, action) ||
+        list_matches(g_hash_table_lookup(by_command, ""), prefix, channel, action)) {
+        return action;
+    }
+    return ROBUSTSESSION_FILTER_PASS;
+}
+
+// Prints how many messages each rule dropped or hid.
+void robustsession_filter_print_stats(void) {
+    for (guint i = 0; rules != NULL && i < rules->len; i++) {
+        struct filter_rule *rule = g_ptr_array_index(rules, i);
+        gchar *dropped = g_strdup_printf("%" G_GUINT64_FORMAT, rule->dropped);
+        gchar *hidden = g_strdup_printf("%" G_GUINT64_FORMAT, rule->hidden);
+        printformat_module(MODULE_NAME, NULL, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_STATS_FILTER,
+                           rule->text, dropped, hidden);
+        g_free(dropped);
+        g_free(hidden);
+    }
+}
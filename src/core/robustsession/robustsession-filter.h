@@ -0,0 +1,26 @@
+#pragma once
+
+// stdlib includes
+#include <stdbool.h>
+
+// irssi includes
+#include "irc.h"
+#include "irc-servers.h"
+
+typedef enum {
+    // Hand the message to irssi as usual.
+    ROBUSTSESSION_FILTER_PASS,
+    // Do not hand the message to irssi at all.
+    ROBUSTSESSION_FILTER_DROP,
+    // Hand the message to irssi (which updates its state), but do not print
+    // it, see robustsession_filter_hide().
+    ROBUSTSESSION_FILTER_HIDE,
+} robustsession_filter_action;
+
+void robustsession_filter_init(void);
+void robustsession_filter_deinit(void);
+
+robustsession_filter_action robustsession_filter_match(SERVER_REC *server, const char *line);
+void robustsession_filter_hide(bool hide);
+
+void robustsession_filter_print_stats(void);
@@ -0,0 +1,11 @@
+#pragma once
+
+// stdlib includes
+#include <stddef.h>
+
+// external library includes
+#include <glib.h>
+
+size_t robustsession_json_plain_prefix(const char *str, size_t len);
+
+char *robustsession_json_post_message(const char *line, guint msgid, size_t *len);
@@ -0,0 +1,152 @@
+// vim:ts=4:sw=4:et
+// © 2015 Michael Stapelberg (see COPYING)
+
+// Measures how long the callbacks which irssi’s main loop invokes in this
+// module take, and how late our timers are dispatched, so that it becomes
+// visible when the module (or irssi as a whole) is sluggish.
+//
+// Each entry point calls robustsession_lag_enter() and
+// robustsession_lag_leave() with its name. Durations are kept in one
+// histogram per name (shown by /robustirc stats), and a callback which takes
+// longer than robustirc_lag_warning is reported, at most once per minute per
+// callback.
+
+// stdlib includes
+#include <stdbool.h>
+#include <string.h>
+
+// external library includes
+#include <glib.h>
+
+// irssi includes
+#include "common.h"
+#include "levels.h"
+#include "printtext.h"
+#include "settings.h"
+
+// module includes
+#include "robustirc.h"
+#include "module-formats.h"
+#include "robustsession-lag.h"
+
+// Bucket i counts durations below 2^i * 250 µs; the last bucket counts
+// everything longer.
+#define LAG_BUCKETS 10
+
+static const gint64 lag_bucket_base = 250;
+static const gint64 lag_warning_interval = 60 * G_USEC_PER_SEC;
+
+struct lag_histogram {
+    guint64 count;
+    gint64 total;
+    gint64 max;
+    guint64 buckets[LAG_BUCKETS];
+    gint64 last_warning;
+    guint suppressed;
+};
+
+// Keyed by callback name (static strings).
+static GHashTable *histograms;
+
+static struct lag_histogram *lag_histogram(const char *name) {
+    if (histograms == NULL) {
+        histograms = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    }
+    struct lag_histogram *histogram = g_hash_table_lookup(histograms, name);
+    if (histogram == NULL) {
+        histogram = g_new0(struct lag_histogram, 1);
+        g_hash_table_insert(histograms, (gpointer)name, histogram);
+    }
+    return histogram;
+}
+
+static void lag_record(const char *name, gint64 usec, gint64 now) {
+    struct lag_histogram *histogram = lag_histogram(name);
+    histogram->count++;
+    histogram->total += usec;
+    histogram->max = MAX(histogram->max, usec);
+    int bucket = 0;
+    while (bucket < LAG_BUCKETS - 1 && usec >= (lag_bucket_base << bucket)) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+
+    const gint64 threshold = (gint64)settings_get_time("robustirc_lag_warning") * 1000;
+    if (threshold <= 0 || usec < threshold) {
+        return;
+    }
+    if (histogram->last_warning != 0 &&
+        now - histogram->last_warning < lag_warning_interval) {
+        histogram->suppressed++;
+        return;
+    }
+    gchar *ms = g_strdup_printf("%.1f", usec / 1000.0);
+    gchar *suppressed = g_strdup_printf("%u", histogram->suppressed);
+    printformat_module(MODULE_NAME, NULL, NULL,
+                       MSGLEVEL_CLIENTNOTICE, ROBUSTIRCTXT_LAG_WARNING,
+                       name, ms, suppressed);
+    g_free(ms);
+    g_free(suppressed);
+    histogram->last_warning = now;
+    histogram->suppressed = 0;
+}
+
+// Returns the start time to pass to robustsession_lag_leave().
+gint64 robustsession_lag_enter(void) {
+    return g_get_monotonic_time();
+}
+
+// Records that the callback |name| ran from |start| until now.
+void robustsession_lag_leave(const char *name, gint64 start) {
+    const gint64 now = g_get_monotonic_time();
+    lag_record(name, now - start, now);
+}
+
+// Records how late a timer which was due at |deadline| (monotonic time) was
+// dispatched by the main loop.
+void robustsession_lag_dispatched(gint64 deadline) {
+    const gint64 now = g_get_monotonic_time();
+    lag_record("main loop dispatch", MAX(now - deadline, 0), now);
+}
+
+// Prints one line per callback with its histogram.
+void robustsession_lag_print_stats(void) {
+    if (histograms == NULL) {
+        return;
+    }
+    GList *names = g_list_sort(g_hash_table_get_keys(histograms), (GCompareFunc)strcmp);
+    for (GList *l = names; l; l = l->next) {
+        struct lag_histogram *histogram = g_hash_table_lookup(histograms, l->data);
+        GString *buckets = g_string_new(NULL);
+        for (int i = 0; i < LAG_BUCKETS; i++) {
+            if (histogram->buckets[i] == 0) {
+                continue;
+            }
+            if (i < LAG_BUCKETS - 1) {
+                g_string_append_printf(buckets, " <%.2fms:%" G_GUINT64_FORMAT,
+                                       (lag_bucket_base << i) / 1000.0, histogram->buckets[i]);
+            } else {
+                g_string_append_printf(buckets, " ≥%.2fms:%" G_GUINT64_FORMAT,
+                                       (lag_bucket_base << (i - 1)) / 1000.0, histogram->buckets[i]);
+            }
+        }
+        gchar *count = g_strdup_printf("%" G_GUINT64_FORMAT, histogram->count);
+        gchar *avg = g_strdup_printf("%.2f", histogram->total / 1000.0 / histogram->count);
+        gchar *max = g_strdup_printf("%.2f", histogram->max / 1000.0);
+        printformat_module(MODULE_NAME, NULL, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_STATS_LAG,
+                           l->data, count, avg, max, buckets->str);
+        g_free(count);
+        g_free(avg);
+        g_free(max);
+        g_string_free(buckets, TRUE);
+    }
+    g_list_free(names);
+}
+
+void robustsession_lag_deinit(void) {
+    if (histograms != NULL) {
+        g_hash_table_destroy(histograms);
+        histograms = NULL;
+    }
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// external library includes
+#include <glib.h>
+
+gint64 robustsession_lag_enter(void);
+void robustsession_lag_leave(const char *name, gint64 start);
+void robustsession_lag_dispatched(gint64 deadline);
+
+void robustsession_lag_print_stats(void);
+void robustsession_lag_deinit(void);
@@ -17,9 +17,15 @@
 #include "irc-servers.h"
 #include "levels.h"
 #include "printtext.h"
+#include "settings.h"
 
 // module includes
+#include "robustirc.h"
+#include "module-formats.h"
+#include "robustsession-lag.h"
 #include "robustsession-network.h"
+#include "robustsession-shm.h"
+#include "robustsession.h"
 
 // Hash table, keyed by lowercase network address (e.g. “robustirc.net”),
 // holding the resolved host:port targets and their current backoff state.
@@ -30,11 +36,92 @@ struct backoff_state {
     time_t next;
 };
 
+// Latencies of a target as measured by robustsession_network_probed(), in
+// microseconds.
+struct target_latency {
+    gint64 rtt;
+    gint64 connect;
+    gint64 tls;
+    guint failures;
+};
+
+// Signals which indicate that a target is on the minority side of a network
+// partition, see partition_evaluate().
+struct target_partition {
+    // The target’s view of the network membership (the Servers list of its
+    // latest RobustPing), sorted and joined by “,”, and when it was received.
+    gchar *view;
+    gint64 view_at;
+    // Number of GetMessages streams which the target ended since
+    // |ends_since|.
+    guint ends;
+    gint64 ends_since;
+    // The target receives no requests until then (g_get_monotonic_time()).
+    gint64 quarantined_until;
+};
+
+// How long a membership view counts, how long a target stays quarantined
+// after the latest signal, and the window in which partition_ends streams
+// need to end to quarantine a target.
+static const gint64 partition_view_ttl = 120 * G_USEC_PER_SEC;
+static const gint64 partition_quarantine = 60 * G_USEC_PER_SEC;
+static const gint64 partition_window = 60 * G_USEC_PER_SEC;
+static const guint partition_ends = 2;
+
 struct network_ctx {
+    // Lowercase network address, e.g. “robustirc.net”.
+    gchar *address;
     GQueue *servers;
+    // The first entry of the latest Servers list, i.e. the raft leader as far
+    // as the network reports it. NULL until the first RobustPing arrived.
+    // Unlike the head of |servers|, it does not rotate on failures.
+    gchar *leader;
     GHashTable *backoff;
+    GHashTable *latency;
+    GHashTable *partition;
+
+    // Targets which receive no new requests (set via /robustirc drain), and
+    // the target which receives all requests (set via /robustirc pin).
+    GHashTable *drained;
+    gchar *pinned;
 };
 
+static void target_partition_free(gpointer data) {
+    struct target_partition *partition = data;
+    g_free(partition->view);
+    g_free(partition);
+}
+
+static struct network_ctx *network_ctx_new(const char *address) {
+    struct network_ctx *ctx = g_new0(struct network_ctx, 1);
+    ctx->address = g_strdup(address);
+    ctx->backoff = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    ctx->latency = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    ctx->partition = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, target_partition_free);
+    ctx->drained = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    return ctx;
+}
+
+static void network_ctx_free(gpointer data) {
+    struct network_ctx *ctx = data;
+    g_queue_free_full(ctx->servers, g_free);
+    g_free(ctx->leader);
+    g_hash_table_destroy(ctx->backoff);
+    g_hash_table_destroy(ctx->latency);
+    g_hash_table_destroy(ctx->partition);
+    g_hash_table_destroy(ctx->drained);
+    g_free(ctx->pinned);
+    g_free(ctx->address);
+    g_free(ctx);
+}
+
+static struct network_ctx *network_ctx_lookup(const char *address) {
+    gchar *key = g_ascii_strdown(address, -1);
+    struct network_ctx *ctx = g_hash_table_lookup(networks, key);
+    g_free(key);
+    return ctx;
+}
+
 struct query {
     SERVER_REC *server;
     robustsession_network_resolved_cb callback;
@@ -78,10 +165,9 @@ static void srv_resolved(GObject *obj, GAsyncResult *res, gpointer user_data) {
         }
     }
 
-    struct network_ctx *ctx = g_new0(struct network_ctx, 1);
-    ctx->servers = servers;
-    ctx->backoff = g_hash_table_new(g_str_hash, g_str_equal);
     gchar *key = g_ascii_strdown(query->server->connrec->address, -1);
+    struct network_ctx *ctx = network_ctx_new(key);
+    ctx->servers = servers;
     g_hash_table_insert(networks, key, ctx);
 
     g_resolver_free_targets(targets);
@@ -93,10 +179,16 @@ static void srv_resolved(GObject *obj, GAsyncResult *res, gpointer user_data) {
 
 bool robustsession_network_init(void) {
     srand(time(NULL));
-    networks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    networks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, network_ctx_free);
     return (networks != NULL);
 }
 
+void robustsession_network_deinit(void) {
+    g_hash_table_destroy(networks);
+    networks = NULL;
+    robustsession_shm_deinit();
+}
+
 void robustsession_network_resolve(
     SERVER_REC *server,
     GCancellable *cancellable,
@@ -112,9 +204,9 @@ void robustsession_network_resolve(
     gchar **targets = g_strsplit(server->connrec->address, ",", -1);
     guint len = g_strv_length(targets);
     if (len > 1) {
-        struct network_ctx *ctx = g_new0(struct network_ctx, 1);
+        gchar *key = g_ascii_strdown(server->connrec->address, -1);
+        struct network_ctx *ctx = network_ctx_new(key);
         ctx->servers = g_queue_new();
-        ctx->backoff = g_hash_table_new(g_str_hash, g_str_equal);
         for (guint i = 0; i < len; i++) {
             gchar *server = g_strdup(targets[i]);
             if (server) {
@@ -126,7 +218,6 @@ void robustsession_network_resolve(
                 }
             }
         }
-        gchar *key = g_ascii_strdown(server->connrec->address, -1);
         g_hash_table_insert(networks, key, ctx);
         g_strfreev(targets);
         callback(server, userdata);
@@ -162,7 +253,8 @@ void robustsession_network_resolve(
 
 struct server_retry_ctx {
     char *address;
-    gboolean random;
+    robustsession_network_pick pick;
+    char *hint;
     robustsession_network_server_cb callback;
     gpointer userdata;
     guint timeout_id;
@@ -170,23 +262,114 @@ struct server_retry_ctx {
     gulong cancellable_handler;
 };
 
+// All server_retry_ctx which wait for their timeout.
+static GList *retries;
+
+// Set by robustsession_network_shutdown().
+static gboolean shutting_down;
+
 static void retry_cancelled(GCancellable *cancellable, gpointer user_data) {
     struct server_retry_ctx *ctx = user_data;
+    retries = g_list_remove(retries, ctx);
     g_source_remove(ctx->timeout_id);
     g_free(ctx->address);
+    g_free(ctx->hint);
     g_free(ctx);
 }
 
 static gboolean robustsession_network_server_retry_cb(gpointer user_data) {
     struct server_retry_ctx *ctx = user_data;
-    robustsession_network_server(
-        ctx->address, ctx->random, ctx->cancellable, ctx->callback, ctx->userdata);
+    const gint64 start = robustsession_lag_enter();
+    retries = g_list_remove(retries, ctx);
+    robustsession_network_server_pick(
+        ctx->address, ctx->pick, ctx->hint, ctx->cancellable, ctx->callback, ctx->userdata);
     g_cancellable_disconnect(ctx->cancellable, ctx->cancellable_handler);
     free(ctx->address);
+    free(ctx->hint);
     free(ctx);
+    robustsession_lag_leave("server_retry_cb", start);
     return FALSE;
 }
 
+// Ignores exponential backoff from now on and places all requests which are
+// waiting for a backoff to expire right away. Used while irssi shuts down, as
+// the glib main loop (and thereby the retry timers) no longer runs.
+void robustsession_network_shutdown(void) {
+    shutting_down = TRUE;
+    while (retries != NULL) {
+        struct server_retry_ctx *ctx = retries->data;
+        g_source_remove(ctx->timeout_id);
+        robustsession_network_server_retry_cb(ctx);
+    }
+}
+
+static gint gcharcmp(gconstpointer a, gconstpointer b);
+
+// Adopts the backoff state which another irssi process published for
+// |target|, if it is stricter than ours.
+static void backoff_sync(struct network_ctx *ctx, const char *target) {
+    time_t next;
+    int exponent;
+    if (!robustsession_shm_lookup(ctx->address, target, &next, &exponent) ||
+        next <= time(NULL)) {
+        return;
+    }
+    struct backoff_state *backoff = g_hash_table_lookup(ctx->backoff, target);
+    if (!backoff) {
+        backoff = g_new0(struct backoff_state, 1);
+        g_hash_table_insert(ctx->backoff, g_strdup(target), backoff);
+    }
+    if (backoff->next < next) {
+        backoff->next = next;
+        backoff->exponent = MAX(backoff->exponent, exponent);
+    }
+}
+
+static gboolean target_quarantined(struct network_ctx *ctx, const char *target) {
+    struct target_partition *partition = g_hash_table_lookup(ctx->partition, target);
+    return (partition && partition->quarantined_until > g_get_monotonic_time());
+}
+
+static gboolean target_healthy(struct network_ctx *ctx, const char *target) {
+    if (g_hash_table_contains(ctx->drained, target) ||
+        target_quarantined(ctx, target)) {
+        return FALSE;
+    }
+    backoff_sync(ctx, target);
+    struct backoff_state *backoff = g_hash_table_lookup(ctx->backoff, target);
+    return (!backoff || backoff->next <= time(NULL) || shutting_down);
+}
+
+// Returns the probed round trip time of |target|, or G_MAXINT64 if |target|
+// was not (successfully) probed yet.
+static gint64 target_rtt(struct network_ctx *ctx, const char *target) {
+    struct target_latency *latency = g_hash_table_lookup(ctx->latency, target);
+    if (!latency || latency->rtt == 0 || latency->failures > 0) {
+        return G_MAXINT64;
+    }
+    return latency->rtt;
+}
+
+// Returns the healthy target (other than |exclude|, if non-NULL) with the
+// lowest probed round trip time. Targets which were not probed yet come last,
+// in queue order.
+static GList *fastest_healthy(struct network_ctx *ctx, const char *exclude) {
+    GList *best = NULL;
+    gint64 best_rtt = G_MAXINT64;
+    for (GList *l = ctx->servers->head; l; l = l->next) {
+        if ((exclude != NULL && gcharcmp(l->data, exclude) == 0) ||
+            !target_healthy(ctx, l->data)) {
+            continue;
+        }
+        const gint64 rtt = target_rtt(ctx, l->data);
+        if (best == NULL || rtt < best_rtt) {
+            best = l;
+            best_rtt = rtt;
+        }
+    }
+    return best;
+}
+
 // Returns TRUE and calls |callback| as soon as a connection to a server for
 // network |address| is possible. Connections might be blocked due to
 // exponential backoff.
@@ -199,13 +382,67 @@ gboolean robustsession_network_server(
     GCancellable *cancellable,
     robustsession_network_server_cb callback,
     gpointer userdata) {
-    gchar *key = g_ascii_strdown(address, -1);
-    struct network_ctx *ctx = g_hash_table_lookup(networks, key);
-    g_free(key);
+    return robustsession_network_server_pick(
+        address,
+        (random ? ROBUSTSESSION_PICK_RANDOM : ROBUSTSESSION_PICK_FIRST),
+        NULL,
+        cancellable,
+        callback,
+        userdata);
+}
+
+// Like robustsession_network_server(), but picks among the healthy targets
+// according to |pick|. |hint| is the target which ROBUSTSESSION_PICK_PREFER
+// prefers and ROBUSTSESSION_PICK_AVOID avoids. Falls back to
+// ROBUSTSESSION_PICK_FIRST when no healthy target matches.
+gboolean robustsession_network_server_pick(
+    const char *address,
+    robustsession_network_pick pick,
+    const char *hint,
+    GCancellable *cancellable,
+    robustsession_network_server_cb callback,
+    gpointer userdata) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
     if (!ctx) {
         return FALSE;
     }
 
+    if (ctx->pinned != NULL) {
+        GList *l = g_queue_find_custom(ctx->servers, ctx->pinned, gcharcmp);
+        if (l != NULL) {
+            callback(l->data, userdata);
+            return TRUE;
+        }
+    }
+
+    if (pick == ROBUSTSESSION_PICK_PREFER && hint != NULL) {
+        GList *l = g_queue_find_custom(ctx->servers, hint, gcharcmp);
+        if (l != NULL && target_healthy(ctx, l->data)) {
+            callback(l->data, userdata);
+            return TRUE;
+        }
+    } else if (pick == ROBUSTSESSION_PICK_AVOID && hint != NULL) {
+        GList *l = fastest_healthy(ctx, hint);
+        if (l != NULL) {
+            callback(l->data, userdata);
+            return TRUE;
+        }
+    } else if (pick == ROBUSTSESSION_PICK_RANDOM) {
+        GPtrArray *healthy = g_ptr_array_new();
+        for (GList *l = ctx->servers->head; l; l = l->next) {
+            if (target_healthy(ctx, l->data)) {
+                g_ptr_array_add(healthy, l->data);
+            }
+        }
+        if (healthy->len > 0) {
+            gchar *s = g_ptr_array_index(healthy, rand() % healthy->len);
+            g_ptr_array_free(healthy, TRUE);
+            callback(s, userdata);
+            return TRUE;
+        }
+        g_ptr_array_free(healthy, TRUE);
+    }
+
 #if 0
     GHashTableIter iter;
     gpointer k, v;
@@ -221,15 +458,15 @@ gboolean robustsession_network_server(
     // available server in case the randomly picked server is unhealthy.
     gchar *server = g_queue_pop_nth(ctx->servers, 0);
 
+#if 0
     struct backoff_state *backoff =
         g_hash_table_lookup(ctx->backoff, server);
 
-#if 0
     printtext(NULL, NULL, MSGLEVEL_CRAP, "backoff = %s for *%s*", (backoff ? "yes" : "no"), server);
     if (backoff)
         printtext(NULL, NULL, MSGLEVEL_CRAP, "current backoff = %d, next = %d for *%s*, time = %d", backoff->exponent, backoff->next, server, time(NULL));
 #endif
-    if (!backoff || backoff->next <= time(NULL)) {
+    if (target_healthy(ctx, server)) {
         // Retry this server next.
         g_queue_push_head(ctx->servers, server);
         callback(server, userdata);
@@ -238,6 +475,17 @@ gboolean robustsession_network_server(
     // Retry this server last.
     g_queue_push_tail(ctx->servers, server);
 
+    // Fail over to the fastest of the remaining servers.
+    GList *fastest = fastest_healthy(ctx, NULL);
+    if (fastest != NULL) {
+        // Retry this server next.
+        gchar *s = fastest->data;
+        g_queue_delete_link(ctx->servers, fastest);
+        g_queue_push_head(ctx->servers, s);
+        callback(s, userdata);
+        return TRUE;
+    }
+
     time_t soonest = LONG_MAX;
     for (guint i = 0; i < g_queue_get_length(ctx->servers); i++) {
         gchar *s = g_queue_peek_nth(ctx->servers, i);
@@ -250,32 +498,42 @@ gboolean robustsession_network_server(
             printtext(NULL, NULL, MSGLEVEL_CRAP, "current backoff = %d, next = %d for *%s*, time = %d", backoff->exponent, backoff->next, s, time(NULL));
 #endif
 
-        if (!backoff || backoff->next <= time(NULL)) {
-            // Retry this server next.
-            s = g_queue_pop_nth(ctx->servers, i);
-            g_queue_push_head(ctx->servers, s);
-            callback(s, userdata);
-            return TRUE;
+        // Drained servers only become available when undrained, and
+        // quarantined servers are only considered once partition_evaluate()
+        // lifted the quarantine.
+        if (!backoff || g_hash_table_contains(ctx->drained, s) ||
+            target_quarantined(ctx, s)) {
+            continue;
         }
-        const time_t wait = backoff->next - time(NULL);
+        // Never wait for 0 seconds (busy looping) or a negative time.
+        const time_t wait = MAX(backoff->next - time(NULL), 1);
         if (wait < soonest) {
             soonest = wait;
         }
     }
 
+    if (soonest == LONG_MAX) {
+        // All servers are drained or quarantined. Rather use one of them than
+        // none.
+        callback(g_queue_peek_head(ctx->servers), userdata);
+        return TRUE;
+    }
+
     struct server_retry_ctx *retry_ctx = g_new0(struct server_retry_ctx, 1);
     retry_ctx->address = g_strdup(address);
-    retry_ctx->random = random;
+    retry_ctx->pick = pick;
+    retry_ctx->hint = g_strdup(hint);
     retry_ctx->callback = callback;
     retry_ctx->userdata = userdata;
     retry_ctx->timeout_id = g_timeout_add_seconds(
         soonest, robustsession_network_server_retry_cb, retry_ctx);
+    retries = g_list_prepend(retries, retry_ctx);
 
     gulong cancellable_handler =
         g_cancellable_connect(cancellable, G_CALLBACK(retry_cancelled), retry_ctx, NULL);
     if (cancellable_handler == 0) {
         // g_cancellable_connect called g_free(retry_ctx).
-        return;
+        return TRUE;
     }
     retry_ctx->cancellable = cancellable;
     retry_ctx->cancellable_handler = cancellable_handler;
@@ -283,8 +541,82 @@ gboolean robustsession_network_server(
     return TRUE;
 }
 
+static const char *placement_names[ROBUSTSESSION_PLACEMENT_COUNT] = {
+    "colocate",
+    "leader",
+    "spread",
+};
+
+// Returns the placement policy configured in robustirc_placement, falling
+// back to ROBUSTSESSION_PLACEMENT_COLOCATE for unknown values.
+robustsession_network_placement robustsession_network_get_placement(void) {
+    const char *value = settings_get_str("robustirc_placement");
+    for (int i = 0; i < ROBUSTSESSION_PLACEMENT_COUNT; i++) {
+        if (value != NULL && g_ascii_strcasecmp(value, placement_names[i]) == 0) {
+            return i;
+        }
+    }
+    return ROBUSTSESSION_PLACEMENT_COLOCATE;
+}
+
+const char *robustsession_network_placement_name(robustsession_network_placement placement) {
+    return placement_names[placement];
+}
+
+// Like robustsession_network_server(), but places the request according to
+// the robustirc_placement policy. |write| is TRUE for PostMessage requests and
+// FALSE for GetMessages requests. |affinity| is the target which the session
+// currently uses for the other kind of request (or NULL).
+//
+// colocate: reads and writes go to the same target, so that a line is echoed
+//           by the node which accepted it, without waiting for replication.
+// leader:   writes go to the first target of the latest Servers list (the
+//           raft leader, as long as the network reports it first), reads go
+//           to any other target. Until a Servers list arrived, writes go to
+//           the first target and reads avoid the writing target.
+// spread:   reads are placed randomly, writes avoid the reading target.
+gboolean robustsession_network_server_placed(
+    const char *address,
+    gboolean write,
+    const char *affinity,
+    GCancellable *cancellable,
+    robustsession_network_server_cb callback,
+    gpointer userdata) {
+    robustsession_network_pick pick = ROBUSTSESSION_PICK_FIRST;
+    struct network_ctx *ctx;
+    switch (robustsession_network_get_placement()) {
+        case ROBUSTSESSION_PLACEMENT_COLOCATE:
+            if (affinity != NULL) {
+                pick = ROBUSTSESSION_PICK_PREFER;
+            } else {
+                pick = (write ? ROBUSTSESSION_PICK_FIRST : ROBUSTSESSION_PICK_RANDOM);
+            }
+            break;
+        case ROBUSTSESSION_PLACEMENT_LEADER:
+            ctx = network_ctx_lookup(address);
+            if (ctx != NULL && ctx->leader != NULL) {
+                pick = (write ? ROBUSTSESSION_PICK_PREFER : ROBUSTSESSION_PICK_AVOID);
+                affinity = ctx->leader;
+            } else {
+                pick = (write ? ROBUSTSESSION_PICK_FIRST : ROBUSTSESSION_PICK_AVOID);
+            }
+            break;
+        case ROBUSTSESSION_PLACEMENT_SPREAD:
+            pick = (write ? ROBUSTSESSION_PICK_AVOID : ROBUSTSESSION_PICK_RANDOM);
+            break;
+        default:
+            break;
+    }
+    return robustsession_network_server_pick(
+        address, pick, affinity, cancellable, callback, userdata);
+}
+
 // Correspondingly adjusts exponential backoff state after |target| failed.
-void robustsession_network_failed(const char *address, const char *target) {
+// |shared| is TRUE if the failure concerns the target itself (e.g. a
+// connection error or a 5xx response) rather than only this session (e.g. an
+// expired session), in which case the backoff state is published to the other
+// irssi processes, see robustsession_shm_publish().
+void robustsession_network_failed(const char *address, const char *target, gboolean shared) {
     gchar *key = g_ascii_strdown(address, -1);
     struct network_ctx *ctx = g_hash_table_lookup(networks, key);
     g_free(key);
@@ -295,6 +627,7 @@ void robustsession_network_failed(const char *address, const char *target) {
     struct backoff_state *backoff = g_hash_table_lookup(ctx->backoff, target);
     if (!backoff) {
         backoff = g_new0(struct backoff_state, 1);
+        g_hash_table_insert(ctx->backoff, g_strdup(target), backoff);
     }
     // Cap the exponential backoff at 2^6 = 64 seconds. In that region, we run
     // into danger of the client disconnecting due to ping timeout.
@@ -304,10 +637,12 @@ void robustsession_network_failed(const char *address, const char *target) {
     backoff->next = time(NULL) +
                     pow(2, backoff->exponent) +
                     (rand() % (backoff->exponent + 1));
+    if (shared) {
+        robustsession_shm_publish(ctx->address, target, backoff->next, backoff->exponent);
+    }
 #if 0
     printtext(NULL, NULL, MSGLEVEL_CRAP, "set backoff = %d, next = %d for *%s*", backoff->exponent, backoff->next, target);
 #endif
-    g_hash_table_replace(ctx->backoff, (gpointer)g_strdup(target), backoff);
 }
 
 void robustsession_network_succeeded(const char *address, const char *target) {
@@ -318,6 +653,184 @@ void robustsession_network_succeeded(const char *address, const char *target) {
         return;
     }
     g_hash_table_remove(ctx->backoff, target);
+
+    time_t next;
+    int exponent;
+    if (robustsession_shm_lookup(ctx->address, target, &next, &exponent)) {
+        robustsession_shm_publish(ctx->address, target, 0, 0);
+    }
+}
+
+// Returns the targets of network |address|, or NULL if |address| was not yet
+// resolved. The queue is owned by the network and only valid until the next
+// call into this module.
+GQueue *robustsession_network_targets(const char *address) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    return (ctx ? ctx->servers : NULL);
+}
+
+// Records the result of an active probe of |target|: the time to establish a
+// TCP connection (|connect|) and TLS session (|tls|), both 0 when an existing
+// connection was reused, and the request round trip time (|rtt|, negative if
+// the probe failed), all in microseconds.
+void robustsession_network_probed(const char *address, const char *target,
+                                  gint64 connect, gint64 tls, gint64 rtt) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx) {
+        return;
+    }
+    struct target_latency *latency = g_hash_table_lookup(ctx->latency, target);
+    if (!latency) {
+        latency = g_new0(struct target_latency, 1);
+        g_hash_table_insert(ctx->latency, g_strdup(target), latency);
+    }
+    if (rtt < 0) {
+        latency->failures++;
+        return;
+    }
+    latency->failures = 0;
+    latency->rtt = (latency->rtt == 0 ? rtt : (3 * latency->rtt + rtt) / 4);
+    if (connect > 0) {
+        latency->connect = connect;
+    }
+    if (tls > 0) {
+        latency->tls = tls;
+    }
+}
+
+// Returns the probed round trip time to |target| of network |address| in
+// microseconds, or -1 if it is not known.
+gint64 robustsession_network_rtt(const char *address, const char *target) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx) {
+        return -1;
+    }
+    const gint64 rtt = target_rtt(ctx, target);
+    return (rtt == G_MAXINT64 ? -1 : rtt);
+}
+
+// Returns the target which a GetMessages request currently on |current|
+// should move to when its stream lifetime is over, or NULL if it should stay.
+// The target is picked randomly among the healthy targets whose round trip
+// time is at most twice the fastest one, so that streams spread out evenly
+// again after e.g. a rolling restart, without moving to a distant target.
+//
+// Like robustsession_network_server_placed(), the robustirc_placement policy
+// applies, with |affinity| being the target which the session currently
+// writes to: under the leader policy, reads never move to the leader. Under
+// the other policies, reads may move anywhere, as writes follow them (colocate)
+// or avoid them (spread) when they are placed next.
+const char *robustsession_network_rebalance(const char *address, const char *current,
+                                            const char *affinity) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx || ctx->pinned != NULL) {
+        return NULL;
+    }
+    const char *avoid = NULL;
+    if (robustsession_network_get_placement() == ROBUSTSESSION_PLACEMENT_LEADER) {
+        avoid = (ctx->leader != NULL ? ctx->leader : affinity);
+    }
+    GList *fastest = fastest_healthy(ctx, NULL);
+    if (fastest == NULL) {
+        return NULL;
+    }
+    const gint64 best_rtt = target_rtt(ctx, fastest->data);
+    GPtrArray *candidates = g_ptr_array_new();
+    for (GList *l = ctx->servers->head; l; l = l->next) {
+        if (!target_healthy(ctx, l->data) ||
+            (avoid != NULL && gcharcmp(l->data, avoid) == 0)) {
+            continue;
+        }
+        const gint64 rtt = target_rtt(ctx, l->data);
+        if (best_rtt == G_MAXINT64 || (rtt != G_MAXINT64 && rtt <= 2 * best_rtt)) {
+            g_ptr_array_add(candidates, l->data);
+        }
+    }
+    if (candidates->len == 0) {
+        g_ptr_array_free(candidates, TRUE);
+        return NULL;
+    }
+    const char *target = g_ptr_array_index(candidates, rand() % candidates->len);
+    g_ptr_array_free(candidates, TRUE);
+    return (gcharcmp(target, current) == 0 ? NULL : target);
+}
+
+// Stops (|drain| is TRUE) or resumes sending new requests to |target|.
+// Returns FALSE if |target| is not a target of network |address|.
+gboolean robustsession_network_drain(const char *address, const char *target, gboolean drain) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx) {
+        return FALSE;
+    }
+    GList *l = g_queue_find_custom(ctx->servers, target, gcharcmp);
+    if (l == NULL) {
+        return FALSE;
+    }
+    if (drain) {
+        g_hash_table_add(ctx->drained, g_strdup(l->data));
+    } else {
+        g_hash_table_remove(ctx->drained, l->data);
+    }
+    return TRUE;
+}
+
+// Sends all requests for network |address| to |target|, regardless of its
+// health, or picks targets as usual again if |target| is NULL. Returns FALSE
+// if |target| is not a target of network |address|.
+gboolean robustsession_network_pin(const char *address, const char *target) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx) {
+        return FALSE;
+    }
+    GList *l = NULL;
+    if (target != NULL &&
+        (l = g_queue_find_custom(ctx->servers, target, gcharcmp)) == NULL) {
+        return FALSE;
+    }
+    g_free(ctx->pinned);
+    ctx->pinned = (l ? g_strdup(l->data) : NULL);
+    return TRUE;
+}
+
+// Returns FALSE if requests which are running on |target| should move to
+// another target because |target| was drained or another target was pinned.
+gboolean robustsession_network_target_usable(const char *address, const char *target) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx) {
+        return TRUE;
+    }
+    if (ctx->pinned != NULL) {
+        return (gcharcmp(ctx->pinned, target) == 0);
+    }
+    return !g_hash_table_contains(ctx->drained, target) &&
+           !target_quarantined(ctx, target);
+}
+
+// Prints the probed latencies of all targets.
+void robustsession_network_print_stats(void) {
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, networks);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct network_ctx *ctx = value;
+        for (GList *l = ctx->servers->head; l; l = l->next) {
+            struct target_latency *latency = g_hash_table_lookup(ctx->latency, l->data);
+            if (!latency) {
+                continue;
+            }
+            gchar *rtt = g_strdup_printf("%.1f", latency->rtt / 1000.0);
+            gchar *connect = g_strdup_printf("%.1f", latency->connect / 1000.0);
+            gchar *tls = g_strdup_printf("%.1f", latency->tls / 1000.0);
+            gchar *failures = g_strdup_printf("%u", latency->failures);
+            printformat_module(MODULE_NAME, NULL, NULL,
+                               MSGLEVEL_CRAP, ROBUSTIRCTXT_STATS_TARGET,
+                               key, l->data, rtt, connect, tls, failures);
+            g_free(rtt);
+            g_free(connect);
+            g_free(tls);
+            g_free(failures);
+        }
+    }
 }
 
 static gint gcharcmp(gconstpointer a, gconstpointer b) {
@@ -329,12 +842,148 @@ static gint gcharcmp(gconstpointer a, gconstpointer b) {
     return g_ascii_strncasecmp(s1, s2, strlen(s1));
 }
 
-void robustsession_network_update_servers(const char *address, GQueue *servers) {
+static struct target_partition *target_partition(struct network_ctx *ctx, const char *target) {
+    struct target_partition *partition = g_hash_table_lookup(ctx->partition, target);
+    if (!partition) {
+        partition = g_new0(struct target_partition, 1);
+        g_hash_table_insert(ctx->partition, g_strdup(target), partition);
+    }
+    return partition;
+}
+
+// Quarantines the targets which are likely on the minority side of a network
+// partition, i.e. whose membership view disagrees with the view of the
+// majority of targets, or which repeatedly ended GetMessages streams (which
+// RobustIRC nodes do when they lose contact with the raft leader). Messages
+// posted to such a target stall until the partition heals, so no request is
+// sent to it until no signal was seen for partition_quarantine.
+//
+// At most a minority of the targets is quarantined: if more targets look
+// partitioned, the signals are more likely caused by our own connectivity.
+//
+// Returns TRUE if a target was newly quarantined.
+static gboolean partition_evaluate(struct network_ctx *ctx) {
+    const gint64 now = g_get_monotonic_time();
+    const guint total = g_queue_get_length(ctx->servers);
+
+    // Find the view which a strict majority of the reporting targets share.
+    GHashTable *votes = g_hash_table_new(g_str_hash, g_str_equal);
+    guint reporting = 0;
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, ctx->partition);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct target_partition *partition = value;
+        if (partition->view == NULL || now - partition->view_at > partition_view_ttl) {
+            continue;
+        }
+        reporting++;
+        const guint count = GPOINTER_TO_UINT(g_hash_table_lookup(votes, partition->view));
+        g_hash_table_insert(votes, partition->view, GUINT_TO_POINTER(count + 1));
+    }
+    const char *majority = NULL;
+    g_hash_table_iter_init(&iter, votes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (reporting >= 2 && GPOINTER_TO_UINT(value) * 2u > reporting) {
+            majority = key;
+        }
+    }
+
+    GPtrArray *suspects = g_ptr_array_new();
+    guint quarantined = 0;
+    for (GList *l = ctx->servers->head; l; l = l->next) {
+        struct target_partition *partition = g_hash_table_lookup(ctx->partition, l->data);
+        if (!partition) {
+            continue;
+        }
+        const gboolean disagrees =
+            (majority != NULL && partition->view != NULL &&
+             now - partition->view_at <= partition_view_ttl &&
+             strcmp(partition->view, majority) != 0);
+        const gboolean ending =
+            (partition->ends >= partition_ends && now - partition->ends_since <= partition_window);
+        if (disagrees || ending) {
+            g_ptr_array_add(suspects, l->data);
+        } else if (partition->quarantined_until > now) {
+            quarantined++;
+        }
+    }
+    g_hash_table_destroy(votes);
+
+    gboolean changed = FALSE;
+    if ((quarantined + suspects->len) * 2 < total) {
+        for (guint i = 0; i < suspects->len; i++) {
+            const char *target = g_ptr_array_index(suspects, i);
+            struct target_partition *partition = g_hash_table_lookup(ctx->partition, target);
+            if (partition->quarantined_until <= now) {
+                printformat_module(MODULE_NAME, NULL, NULL,
+                                   MSGLEVEL_CLIENTNOTICE, ROBUSTIRCTXT_TARGET_STATE,
+                                   ctx->address, target, "quarantined");
+                changed = TRUE;
+            }
+            partition->quarantined_until = now + partition_quarantine;
+        }
+    }
+    g_ptr_array_free(suspects, TRUE);
+    return changed;
+}
+
+static gint memberscmp(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+// Counts a GetMessages stream which |target| ended although it should have
+// kept it open. Returns TRUE if |target| was quarantined as a result, see
+// partition_evaluate().
+gboolean robustsession_network_stream_ended(const char *address, const char *target) {
+    struct network_ctx *ctx = network_ctx_lookup(address);
+    if (!ctx) {
+        return FALSE;
+    }
+    struct target_partition *partition = target_partition(ctx, target);
+    const gint64 now = g_get_monotonic_time();
+    if (now - partition->ends_since > partition_window) {
+        partition->ends = 0;
+        partition->ends_since = now;
+    }
+    partition->ends++;
+    return partition_evaluate(ctx);
+}
+
+// Updates the targets of network |address| to the Servers list |servers|,
+// which |target| sent, and records it as the membership view of |target|.
+// Returns TRUE if a target was quarantined as a result, see
+// partition_evaluate().
+gboolean robustsession_network_update_servers(const char *address, const char *target, GQueue *servers) {
     gchar *key = g_ascii_strdown(address, -1);
     struct network_ctx *ctx = g_hash_table_lookup(networks, key);
     g_free(key);
     if (!ctx) {
-        return;
+        g_queue_free_full(servers, g_free);
+        return FALSE;
+    }
+
+    GPtrArray *members = g_ptr_array_new_with_free_func(g_free);
+    for (GList *l = servers->head; l; l = l->next) {
+        g_ptr_array_add(members, g_ascii_strdown(l->data, -1));
+    }
+    g_ptr_array_sort(members, memberscmp);
+    g_ptr_array_add(members, NULL);
+    struct target_partition *partition = target_partition(ctx, target);
+    g_free(partition->view);
+    partition->view = g_strjoinv(",", (gchar **)members->pdata);
+    partition->view_at = g_get_monotonic_time();
+    g_ptr_array_free(members, TRUE);
+    const gboolean changed = partition_evaluate(ctx);
+    if (target_quarantined(ctx, target)) {
+        // Do not adopt the view of a partitioned target.
+        g_queue_free_full(servers, g_free);
+        return changed;
+    }
+
+    if (!g_queue_is_empty(servers)) {
+        g_free(ctx->leader);
+        ctx->leader = g_strdup(g_queue_peek_head(servers));
     }
 
     // Skip the update if both queues contain the same entries so that our retry
@@ -349,11 +998,12 @@ void robustsession_network_update_servers(const char *address, GQueue *servers)
     }
     if (equal) {
         g_queue_free_full(servers, g_free);
-        return;
+        return changed;
     }
 
     g_queue_free_full(ctx->servers, g_free);
     ctx->servers = servers;
 
     // TODO: delete entries in ctx->backoff which now no longer have a corresponding server
+    return changed;
 }
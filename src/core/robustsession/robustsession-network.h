@@ -12,7 +12,25 @@ typedef void (*robustsession_network_resolved_cb)(SERVER_REC *server,
 typedef void (*robustsession_network_server_cb)(const char *target,
                                                 gpointer userdata);
 
+typedef enum {
+    ROBUSTSESSION_PICK_FIRST,
+    ROBUSTSESSION_PICK_RANDOM,
+    ROBUSTSESSION_PICK_PREFER,
+    ROBUSTSESSION_PICK_AVOID,
+} robustsession_network_pick;
+
+// How a session places its GetMessages and PostMessage requests on the
+// targets of a network, see the robustirc_placement setting.
+typedef enum {
+    ROBUSTSESSION_PLACEMENT_COLOCATE,
+    ROBUSTSESSION_PLACEMENT_LEADER,
+    ROBUSTSESSION_PLACEMENT_SPREAD,
+    ROBUSTSESSION_PLACEMENT_COUNT,
+} robustsession_network_placement;
+
 bool robustsession_network_init(void);
+void robustsession_network_deinit(void);
+void robustsession_network_shutdown(void);
 
 void robustsession_network_resolve(
     SERVER_REC *server,
@@ -27,8 +45,47 @@ gboolean robustsession_network_server(
     robustsession_network_server_cb callback,
     gpointer userdata);
 
-void robustsession_network_failed(const char *address, const char *target);
+gboolean robustsession_network_server_pick(
+    const char *address,
+    robustsession_network_pick pick,
+    const char *hint,
+    GCancellable *cancellable,
+    robustsession_network_server_cb callback,
+    gpointer userdata);
+
+robustsession_network_placement robustsession_network_get_placement(void);
+const char *robustsession_network_placement_name(robustsession_network_placement placement);
+
+gboolean robustsession_network_server_placed(
+    const char *address,
+    gboolean write,
+    const char *affinity,
+    GCancellable *cancellable,
+    robustsession_network_server_cb callback,
+    gpointer userdata);
+
+void robustsession_network_failed(const char *address, const char *target, gboolean shared);
 
 void robustsession_network_succeeded(const char *address, const char *target);
 
-void robustsession_network_update_servers(const char *address, GQueue *servers);
+gboolean robustsession_network_update_servers(const char *address, const char *target, GQueue *servers);
+
+gboolean robustsession_network_stream_ended(const char *address, const char *target);
+
+GQueue *robustsession_network_targets(const char *address);
+
+void robustsession_network_probed(const char *address, const char *target,
+                                  gint64 connect, gint64 tls, gint64 rtt);
+
+gint64 robustsession_network_rtt(const char *address, const char *target);
+
+const char *robustsession_network_rebalance(const char *address, const char *current,
+                                            const char *affinity);
+
+gboolean robustsession_network_drain(const char *address, const char *target, gboolean drain);
+
+gboolean robustsession_network_pin(const char *address, const char *target);
+
+gboolean robustsession_network_target_usable(const char *address, const char *target);
+
+void robustsession_network_print_stats(void);
@@ -0,0 +1,222 @@
+// vim:ts=4:sw=4:et
+// © 2015 Michael Stapelberg (see COPYING)
+
+// Target health table shared by all irssi processes of a user which set
+// robustirc_shared_health to the same file (e.g. robustirc-health). Relative
+// paths are resolved against $XDG_RUNTIME_DIR. When one process backs off
+// from a target, the others do, too, instead of each running into the same
+// timeouts.
+//
+// The table is per user: it is created with mode 0600, and a file owned by
+// another user is refused, as whoever can write the table can make us back
+// off from every target.
+//
+// The file contains a fixed-size open-addressing hash table. Entries are
+// claimed with compare-and-swap and never removed; their state is a single
+// 64-bit word, so that readers and writers need no locks.
+
+// stdlib includes
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// external library includes
+#include <glib.h>
+
+// irssi includes
+#include "common.h"
+#include "levels.h"
+#include "printtext.h"
+#include "settings.h"
+
+// module includes
+#include "robustsession-shm.h"
+
+// “RHT1”: RobustIRC health table, version 1.
+static const uint32_t shm_magic = 0x52485431;
+
+#define SHM_SLOTS 1024
+// Number of slots to try before giving up on a full table.
+#define SHM_PROBES 16
+
+struct shm_slot {
+    // Hash of network address and target, 0 for free slots.
+    uint64_t key;
+    // Wall clock time before which the target should not be used, shifted
+    // left by 8 bits, plus the backoff exponent in the low 8 bits.
+    uint64_t state;
+};
+
+struct shm_table {
+    uint32_t magic;
+    uint32_t slots;
+    struct shm_slot slot[SHM_SLOTS];
+};
+
+// The file which |table| maps, or which failed to map (|table| is NULL).
+static gchar *shm_path;
+static struct shm_table *table;
+
+static void shm_close(void) {
+    if (table != NULL) {
+        munmap(table, sizeof(struct shm_table));
+        table = NULL;
+    }
+    g_free(shm_path);
+    shm_path = NULL;
+}
+
+static struct shm_table *shm_open_path(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot open shared health table %s: %s",
+                  path, g_strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_uid != geteuid()) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: shared health table %s belongs to another user",
+                  path);
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size < (off_t)sizeof(struct shm_table) &&
+         ftruncate(fd, sizeof(struct shm_table)) == -1)) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot size shared health table %s: %s",
+                  path, g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    struct shm_table *t = mmap(NULL, sizeof(struct shm_table),
+                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot map shared health table %s: %s",
+                  path, g_strerror(errno));
+        return NULL;
+    }
+
+    // The first process initializes the (zero-filled) file.
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&t->magic, &expected, shm_magic, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&t->slots, SHM_SLOTS, __ATOMIC_RELEASE);
+    } else if (expected != shm_magic) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: %s is not a shared health table", path);
+        munmap(t, sizeof(struct shm_table));
+        return NULL;
+    }
+    return t;
+}
+
+// Returns the table configured in robustirc_shared_health, or NULL if
+// sharing is disabled or the table cannot be used.
+static struct shm_table *shm_table(void) {
+    const char *path = settings_get_str("robustirc_shared_health");
+    if (path == NULL || *path == '\0') {
+        if (shm_path != NULL) {
+            shm_close();
+        }
+        return NULL;
+    }
+    if (shm_path == NULL || strcmp(shm_path, path) != 0) {
+        shm_close();
+        shm_path = g_strdup(path);
+        if (g_path_is_absolute(path)) {
+            table = shm_open_path(path);
+        } else {
+            gchar *abs = g_build_filename(g_get_user_runtime_dir(), path, NULL);
+            table = shm_open_path(abs);
+            g_free(abs);
+        }
+    }
+    return table;
+}
+
+// FNV-1a over the lowercase network address and target. Never returns 0,
+// which marks free slots.
+static uint64_t shm_key(const char *address, const char *target) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (const char *p = address; *p; p++) {
+        hash = (hash ^ (uint8_t)g_ascii_tolower(*p)) * UINT64_C(1099511628211);
+    }
+    hash = (hash ^ ' ') * UINT64_C(1099511628211);
+    for (const char *p = target; *p; p++) {
+        hash = (hash ^ (uint8_t)g_ascii_tolower(*p)) * UINT64_C(1099511628211);
+    }
+    return (hash == 0 ? 1 : hash);
+}
+
+static struct shm_slot *shm_slot(struct shm_table *t, uint64_t key, bool create) {
+    for (uint64_t i = 0; i < SHM_PROBES; i++) {
+        struct shm_slot *slot = &t->slot[(key + i) % SHM_SLOTS];
+        uint64_t current = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+        if (current == key) {
+            return slot;
+        }
+        if (current != 0) {
+            continue;
+        }
+        if (!create) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&slot->key, &current, key, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+            current == key) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+void robustsession_shm_deinit(void) {
+    shm_close();
+}
+
+// Tells all processes that |target| should not be used before |next| (0 if
+// it works again).
+void robustsession_shm_publish(const char *address, const char *target,
+                               time_t next, int exponent) {
+    struct shm_table *t = shm_table();
+    if (t == NULL) {
+        return;
+    }
+    struct shm_slot *slot = shm_slot(t, shm_key(address, target), next != 0);
+    if (slot == NULL) {
+        return;
+    }
+    const uint64_t state = (next == 0 ? 0 : ((uint64_t)next << 8) | (uint8_t)exponent);
+    __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+}
+
+// Returns true and stores the backoff state which any process published for
+// |target| in |next| and |exponent|, or returns false if there is none.
+bool robustsession_shm_lookup(const char *address, const char *target,
+                              time_t *next, int *exponent) {
+    struct shm_table *t = shm_table();
+    if (t == NULL) {
+        return false;
+    }
+    struct shm_slot *slot = shm_slot(t, shm_key(address, target), false);
+    if (slot == NULL) {
+        return false;
+    }
+    const uint64_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == 0) {
+        return false;
+    }
+    *next = (time_t)(state >> 8);
+    *exponent = (int)(state & 0xff);
+    return true;
+}
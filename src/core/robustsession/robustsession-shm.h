@@ -0,0 +1,13 @@
+#pragma once
+
+// stdlib includes
+#include <stdbool.h>
+#include <time.h>
+
+void robustsession_shm_deinit(void);
+
+void robustsession_shm_publish(const char *address, const char *target,
+                               time_t next, int exponent);
+
+bool robustsession_shm_lookup(const char *address, const char *target,
+                              time_t *next, int *exponent);
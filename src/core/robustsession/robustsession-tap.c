@@ -0,0 +1,207 @@
+// vim:ts=4:sw=4:et
+// © 2015 Michael Stapelberg (see COPYING)
+
+// Publishes every message which is passed to irssi into a memory-mapped ring
+// buffer (the file set in robustirc_tap), so that local processes such as log
+// indexers can follow the message stream without a session of their own and
+// without any syscalls per message.
+//
+// The file starts with a struct tap_header, followed by the ring at offset
+// |header_size|. Each record starts with a struct tap_record and is padded to
+// a multiple of 8 bytes; a record with data_len == UINT32_MAX only fills the
+// rest of the ring before wrapping around. |head| is the total number of bytes
+// written and is updated (with release semantics) after each record.
+// |reserve| is the total number of bytes which are written or being written:
+// the producer advances it before it overwrites any bytes of the ring.
+//
+// Consumers keep their own read position |tail|. They read records up to
+// |head|, starting at |tail| % capacity, and after copying a record (and an
+// acquire fence) check that |reserve| - |tail| <= |capacity| still holds;
+// otherwise the record was (possibly partially) overwritten while they read
+// it, and they continue at |head|. A changed |epoch| means the producer
+// restarted, possibly with a different |capacity|.
+//
+// The file only ever grows: consumers might still have mapped a larger ring,
+// and accessing pages beyond the end of a shrunk file raises SIGBUS.
+//
+// There must be only one producer per file, so each irssi process needs its
+// own file.
+
+// stdlib includes
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// external library includes
+#include <glib.h>
+
+// irssi includes
+#include "common.h"
+#include "levels.h"
+#include "printtext.h"
+#include "settings.h"
+
+// module includes
+#include "robustsession-tap.h"
+
+// “RTP2”: RobustIRC tap, version 2.
+static const uint32_t tap_magic = 0x52545032;
+
+struct tap_header {
+    uint32_t magic;
+    uint32_t header_size;
+    uint64_t capacity;
+    uint64_t epoch;
+    uint64_t head;
+    uint64_t reserve;
+};
+
+struct tap_record {
+    uint32_t len;
+    uint32_t data_len;
+    uint64_t id;
+    uint64_t reply;
+    // Wall clock time in microseconds since the epoch when the message was
+    // passed to irssi.
+    int64_t timestamp;
+};
+
+static const size_t tap_header_size = 4096;
+
+// The file which |header| maps, or which failed to map (|header| is NULL).
+static gchar *tap_path;
+static int tap_fd = -1;
+static struct tap_header *header;
+static size_t tap_mapped;
+
+static void tap_close(void) {
+    if (header != NULL) {
+        munmap(header, tap_mapped);
+        header = NULL;
+    }
+    if (tap_fd != -1) {
+        close(tap_fd);
+        tap_fd = -1;
+    }
+    g_free(tap_path);
+    tap_path = NULL;
+}
+
+static void tap_open(const char *path, size_t capacity) {
+    tap_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (tap_fd == -1) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot open tap %s: %s", path, g_strerror(errno));
+        return;
+    }
+    // The lock is held as long as the file is open and guards against a
+    // second producer.
+    if (flock(tap_fd, LOCK_EX | LOCK_NB) == -1) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: tap %s is in use by another process", path);
+        close(tap_fd);
+        tap_fd = -1;
+        return;
+    }
+    tap_mapped = tap_header_size + capacity;
+    struct stat st;
+    if (fstat(tap_fd, &st) == -1 ||
+        (st.st_size < (off_t)tap_mapped && ftruncate(tap_fd, (off_t)tap_mapped) == -1)) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot size tap %s: %s", path, g_strerror(errno));
+        close(tap_fd);
+        tap_fd = -1;
+        return;
+    }
+    struct tap_header *h = mmap(NULL, tap_mapped, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, tap_fd, 0);
+    if (h == MAP_FAILED) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot map tap %s: %s", path, g_strerror(errno));
+        close(tap_fd);
+        tap_fd = -1;
+        return;
+    }
+
+    // Consumers ignore the file until the magic is set again.
+    __atomic_store_n(&h->magic, 0, __ATOMIC_RELEASE);
+    h->header_size = tap_header_size;
+    h->capacity = capacity;
+    h->epoch = (uint64_t)g_get_real_time();
+    __atomic_store_n(&h->head, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->reserve, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->magic, tap_magic, __ATOMIC_RELEASE);
+    header = h;
+}
+
+// Returns the tap configured in robustirc_tap, or NULL if the tap is disabled
+// or cannot be used.
+static struct tap_header *tap_header(void) {
+    const char *path = settings_get_str("robustirc_tap");
+    if (path == NULL || *path == '\0') {
+        if (tap_path != NULL) {
+            tap_close();
+        }
+        return NULL;
+    }
+    if (tap_path == NULL || strcmp(tap_path, path) != 0) {
+        tap_close();
+        tap_path = g_strdup(path);
+        // A power of two between 64 KiB and 1 GiB.
+        const guint64 size = CLAMP((guint64)settings_get_size("robustirc_tap_size"),
+                                   G_GUINT64_CONSTANT(1) << 16,
+                                   G_GUINT64_CONSTANT(1) << 30);
+        size_t capacity = 1 << 16;
+        while (capacity < size) {
+            capacity <<= 1;
+        }
+        tap_open(path, capacity);
+    }
+    return header;
+}
+
+void robustsession_tap_deinit(void) {
+    tap_close();
+}
+
+// Appends the message |data| with Id |id|.|reply| to the tap, if enabled.
+void robustsession_tap_publish(uint64_t id, uint64_t reply, const char *data) {
+    struct tap_header *h = tap_header();
+    if (h == NULL) {
+        return;
+    }
+    const size_t data_len = strlen(data);
+    const size_t len = (sizeof(struct tap_record) + data_len + 7) & ~(size_t)7;
+    if (len > h->capacity / 2) {
+        return;
+    }
+    char *ring = (char *)h + h->header_size;
+    uint64_t head = h->head;
+    size_t pos = head % h->capacity;
+    // Announce which bytes are about to be overwritten (including the padding
+    // record, if any) before touching them, see the consumer protocol above.
+    const uint64_t end = head + len + (h->capacity - pos < len ? h->capacity - pos : 0);
+    __atomic_store_n(&h->reserve, end, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (h->capacity - pos < len) {
+        struct tap_record *pad = (struct tap_record *)(ring + pos);
+        pad->len = (uint32_t)(h->capacity - pos);
+        pad->data_len = UINT32_MAX;
+        head += h->capacity - pos;
+        pos = 0;
+    }
+    struct tap_record *record = (struct tap_record *)(ring + pos);
+    record->len = (uint32_t)len;
+    record->data_len = (uint32_t)data_len;
+    record->id = id;
+    record->reply = reply;
+    record->timestamp = g_get_real_time();
+    memcpy(record + 1, data, data_len);
+    __atomic_store_n(&h->head, head + len, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// stdlib includes
+#include <stdint.h>
+
+void robustsession_tap_deinit(void);
+
+void robustsession_tap_publish(uint64_t id, uint64_t reply, const char *data);
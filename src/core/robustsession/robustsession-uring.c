@@ -0,0 +1,292 @@
+// vim:ts=4:sw=4:et
+// © 2015 Michael Stapelberg (see COPYING)
+
+// Optional io_uring backend for watching libcurl’s sockets (set
+// robustirc_io_backend to “io_uring”), used instead of one glib source per
+// socket.
+//
+// Each socket which libcurl wants watched gets a multishot poll request, which
+// stays armed until libcurl changes its interest in the socket or removes it,
+// so that a busy GetMessages stream does not re-register a watch for every
+// chunk. libcurl expects level-triggered readiness (it might leave data
+// unread), so poll requests are level-triggered (IORING_POLL_ADD_LEVEL); on
+// kernels without support for that, single-shot poll requests are re-armed
+// after every completion instead. Poll requests are not submitted right away, but collected and
+// submitted in one io_uring_submit() call per main loop iteration. Completions
+// are signalled through a single eventfd, which is the only file descriptor
+// irssi’s main loop watches for us; when it becomes readable, all
+// completions are reaped and passed to libcurl together with the events that
+// occurred, so that libcurl does not need to poll() the socket again.
+//
+// The backend is only compiled in when liburing is found at build time.
+
+// stdlib includes
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+#endif
+
+// external library includes
+#include <curl/curl.h>
+#include <glib.h>
+
+// irssi includes
+#include "common.h"
+#include "misc.h"
+#include "levels.h"
+#include "printtext.h"
+
+// module includes
+#include "robustsession-lag.h"
+#include "robustsession-uring.h"
+
+#ifdef HAVE_LIBURING
+
+// Number of submission queue entries. When more poll requests are pending
+// than fit into the queue, they are submitted early.
+static const unsigned uring_entries = 256;
+
+// The socketp libcurl stores for each watched socket. A watch is replaced
+// (never modified) when libcurl changes its interest in the socket, so
+// completions of a cancelled poll request can be told apart from completions
+// of the current one.
+struct uring_watch {
+    CURLM *multi;
+    curl_socket_t fd;
+    unsigned events;
+    bool cancelled;
+};
+
+static struct io_uring ring;
+static bool ring_active;
+static int event_fd = -1;
+static int event_tag;
+static guint submit_tag;
+static robustsession_uring_ready_cb ready_cb;
+// Cleared once the kernel rejected a level-triggered multishot poll request.
+static bool poll_level = true;
+// All watches whose poll request has not completed for good, including
+// cancelled ones, so that they can be freed on deinit.
+static GHashTable *watches;
+
+static gboolean submit_cb(gpointer user_data) {
+    (void)user_data;
+    submit_tag = 0;
+    int ret = io_uring_submit(&ring);
+    if (ret < 0) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: io_uring_submit: %s", g_strerror(-ret));
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Returns a submission queue entry. Submits the pending entries first if the
+// queue is full.
+static struct io_uring_sqe *uring_sqe(void) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+    }
+    if (submit_tag == 0) {
+        submit_tag = g_idle_add(submit_cb, NULL);
+    }
+    return sqe;
+}
+
+static void uring_arm(struct uring_watch *watch) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+#ifdef IORING_POLL_ADD_LEVEL
+    if (poll_level) {
+        io_uring_prep_poll_multishot(sqe, watch->fd, watch->events);
+        sqe->len |= IORING_POLL_ADD_LEVEL;
+    } else {
+        io_uring_prep_poll_add(sqe, watch->fd, watch->events);
+    }
+#else
+    io_uring_prep_poll_add(sqe, watch->fd, watch->events);
+#endif
+    io_uring_sqe_set_data(sqe, watch);
+}
+
+static void uring_cancel(struct uring_watch *watch) {
+    watch->cancelled = true;
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (sqe == NULL) {
+        return;
+    }
+    io_uring_prep_poll_remove(sqe, (__u64)(uintptr_t)watch);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+static int uring_bitmask(int revents) {
+    int bitmask = 0;
+    if (revents & (POLLIN | POLLHUP)) {
+        bitmask |= CURL_CSELECT_IN;
+    }
+    if (revents & POLLOUT) {
+        bitmask |= CURL_CSELECT_OUT;
+    }
+    if (revents & POLLERR) {
+        bitmask |= CURL_CSELECT_ERR;
+    }
+    return bitmask;
+}
+
+/* irssi callback which reaps all io_uring completions. */
+static void event_cb(void *data, GIOChannel *source, int condition) {
+    (void)data;
+    (void)source;
+    (void)condition;
+    const gint64 start = robustsession_lag_enter();
+    eventfd_t value;
+    eventfd_read(event_fd, &value);
+
+    struct io_uring_cqe *cqe;
+    while (ring_active && io_uring_peek_cqe(&ring, &cqe) == 0) {
+        struct uring_watch *watch = io_uring_cqe_get_data(cqe);
+        const int res = cqe->res;
+        const bool more = (cqe->flags & IORING_CQE_F_MORE);
+        io_uring_cqe_seen(&ring, cqe);
+        if (watch == NULL) {
+            // Completion of a poll removal request.
+            continue;
+        }
+        if (watch->cancelled) {
+            if (!more) {
+                g_hash_table_remove(watches, watch);
+            }
+            continue;
+        }
+        if (res == -EINVAL && poll_level) {
+            // Level-triggered multishot polls are not supported.
+            poll_level = false;
+            uring_arm(watch);
+            continue;
+        }
+        if (!more) {
+            // The request was single-shot, or the kernel ended the multishot
+            // request (e.g. because the completion queue overflowed), so
+            // re-arm it.
+            uring_arm(watch);
+        }
+        if (res > 0) {
+            ready_cb(watch->multi, watch->fd, uring_bitmask(res));
+        } else if (res < 0 && res != -ECANCELED) {
+            ready_cb(watch->multi, watch->fd, CURL_CSELECT_ERR);
+        }
+    }
+    robustsession_lag_leave("io_uring event_cb", start);
+}
+
+bool robustsession_uring_init(robustsession_uring_ready_cb ready) {
+    if (ring_active) {
+        return true;
+    }
+    int ret = io_uring_queue_init(uring_entries, &ring, 0);
+    if (ret < 0) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: io_uring_queue_init: %s", g_strerror(-ret));
+        return false;
+    }
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1 || io_uring_register_eventfd(&ring, event_fd) < 0) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: cannot register io_uring eventfd: %s", g_strerror(errno));
+        if (event_fd != -1) {
+            close(event_fd);
+            event_fd = -1;
+        }
+        io_uring_queue_exit(&ring);
+        return false;
+    }
+    GIOChannel *handle = i_io_channel_new(event_fd);
+    event_tag = i_input_add(handle, I_INPUT_READ, event_cb, NULL);
+    g_io_channel_unref(handle);
+
+    watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, g_free, NULL);
+    ready_cb = ready;
+    ring_active = true;
+    return true;
+}
+
+bool robustsession_uring_active(void) {
+    return ring_active;
+}
+
+void robustsession_uring_deinit(void) {
+    if (!ring_active) {
+        return;
+    }
+    ring_active = false;
+    if (submit_tag != 0) {
+        g_source_remove(submit_tag);
+        submit_tag = 0;
+    }
+    g_source_remove(event_tag);
+    event_tag = 0;
+    // Exiting the ring cancels all outstanding poll requests.
+    io_uring_queue_exit(&ring);
+    close(event_fd);
+    event_fd = -1;
+    g_hash_table_destroy(watches);
+    watches = NULL;
+}
+
+// Watches |fd| for the events in |what| (a CURL_POLL_* value), replacing the
+// previous watch |socketp|. Returns the new socketp for curl_multi_assign().
+void *robustsession_uring_watch(CURLM *multi, curl_socket_t fd, int what, void *socketp) {
+    struct uring_watch *old = socketp;
+    if (old != NULL) {
+        uring_cancel(old);
+    }
+    if (what == CURL_POLL_REMOVE) {
+        return NULL;
+    }
+    struct uring_watch *watch = g_new0(struct uring_watch, 1);
+    watch->multi = multi;
+    watch->fd = fd;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) {
+        watch->events |= POLLIN;
+    }
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) {
+        watch->events |= POLLOUT;
+    }
+    g_hash_table_add(watches, watch);
+    uring_arm(watch);
+    return watch;
+}
+
+#else
+
+bool robustsession_uring_init(robustsession_uring_ready_cb ready) {
+    (void)ready;
+    printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+              "RobustIRC: this build does not support io_uring");
+    return false;
+}
+
+bool robustsession_uring_active(void) {
+    return false;
+}
+
+void robustsession_uring_deinit(void) {
+}
+
+void *robustsession_uring_watch(CURLM *multi, curl_socket_t fd, int what, void *socketp) {
+    (void)multi;
+    (void)fd;
+    (void)what;
+    (void)socketp;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,17 @@
+#pragma once
+
+// stdlib includes
+#include <stdbool.h>
+
+// external library includes
+#include <curl/curl.h>
+
+typedef void (*robustsession_uring_ready_cb)(CURLM *multi, curl_socket_t fd,
+                                             int ev_bitmask);
+
+bool robustsession_uring_init(robustsession_uring_ready_cb ready);
+bool robustsession_uring_active(void);
+void robustsession_uring_deinit(void);
+
+void *robustsession_uring_watch(CURLM *multi, curl_socket_t fd, int what,
+                                void *socketp);
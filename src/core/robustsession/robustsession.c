@@ -8,6 +8,10 @@
 #include <assert.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 // external library includes
 #include <curl/curl.h>
@@ -25,12 +29,20 @@
 #include "printtext.h"
 #include "irc.h"
 #include "irc-servers.h"
+#include "channels.h"
+#include "settings.h"
 #include "rawlog.h"
+#include "lib-config/iconfig.h"
 
 // module includes
 #include "robustirc.h"
 #include "module-formats.h"
+#include "robustsession-filter.h"
+#include "robustsession-json.h"
+#include "robustsession-lag.h"
 #include "robustsession-network.h"
+#include "robustsession-tap.h"
+#include "robustsession-uring.h"
 
 // irssi 1.0 backward compatibility
 // IRSSI_ABI_VERSION was introduced in 0.8.18
@@ -47,6 +59,99 @@ static const long robustping = 4;
 // network.
 static CURLM *curl_handle;
 static CURLM *curl_handle_gm;
+// Latency probes get their own multi handle: on curl_handle, they would queue
+// behind the pipelined PostMessages and measure those instead of the target.
+static CURLM *curl_handle_probe;
+
+// How long transport_init() took, reported along with the first session.
+static gint64 transport_init_usec = -1;
+
+// Reads the CA bundle into the page cache, see ca_bundle_prefetch().
+static GThread *ca_bundle_thread;
+
+// The glib timer currently scheduled on behalf of each multi handle, so that
+// robustsession_deinit() can remove it.
+static guint *timers[3];
+
+// Active latency probes (CURL handles), see probe_round(), and the glib timer
+// which starts the next round.
+static GList *probes;
+static guint probe_tag;
+
+// Watches the local network configuration, see network_monitor_changed().
+static GNetworkMonitor *network_monitor;
+static gulong network_monitor_handler;
+static guint network_monitor_tag;
+// Until this g_get_monotonic_time(), requests do not reuse connections, which
+// might have silently died when the local network changed.
+static gint64 fresh_connect_until;
+
+// Smoothed interval between two RobustPing messages on a GetMessages stream
+// (in microseconds), or 0 until observed, see gm_sockopt().
+static gint64 robustping_interval;
+static const gint64 robustping_interval_default = 20 * G_USEC_PER_SEC;
+
+// Difference between CLOCK_BOOTTIME and CLOCK_MONOTONIC (in microseconds) at
+// the last suspend_check(), and the glib timer which calls it periodically.
+static gint64 suspend_offset = -1;
+static guint suspend_tag;
+
+// All sessions which are not yet freed, including those which are still
+// delivering their last messages after robustsession_destroy().
+static GList *sessions;
+
+// Time between sending a line which the IRC server echoes back to its sender
+// (e.g. JOIN) and receiving the echo, per placement policy. Shows which
+// robustirc_placement policy works best for a network.
+static struct {
+    guint count;
+    gint64 sum;
+    gint64 max;
+} echo_stats[ROBUSTSESSION_PLACEMENT_COUNT];
+
+// Buckets of the batch size histogram: 1, 2–3, 4–7, …, ≥ 128 lines.
+#define COALESCE_BUCKETS 8
+
+// Batches of outgoing lines handed to send_pump() by coalesce_flush(), and the
+// coalescing windows which were in effect.
+static struct {
+    guint64 batches[COALESCE_BUCKETS];
+    guint64 flushes;
+    gint64 window_sum;
+    gint64 window_max;
+} coalesce_stats;
+
+// A line awaiting its echo, see echo_probe_sent().
+struct echo_probe {
+    gchar *key;
+    gint64 sent;
+    robustsession_network_placement placement;
+};
+
+// At most this many echo probes are tracked per session, and for no longer
+// than echo_probe_timeout microseconds.
+static const guint echo_probes_max = 16;
+static const gint64 echo_probe_timeout = 60 * G_USEC_PER_SEC;
+
+// Lines which become useless when they are delivered late (e.g. after an
+// outage) or which are superseded by a newer line of the same kind. Lines of
+// other kinds are always delivered.
+static const struct {
+    const char *name;
+    // Lines older than this (in seconds) are dropped, 0 means never.
+    int lifetime;
+    // If true, queueing a line drops all queued lines of the same kind.
+    bool collapse;
+} send_classes[] = {
+    // Answers a server PING, which will have timed out by then.
+    {"PONG", 30, false},
+    // Automatic CTCP replies (NOTICE with a \001-quoted message).
+    {"CTCP reply", 60, false},
+    {"AWAY", 0, true},
+    {"NICK", 0, true},
+};
+
+#define SEND_CLASSES (sizeof(send_classes) / sizeof(send_classes[0]))
 
 // TODO: when is this freed?
 struct t_robustsession_ctx {
@@ -58,8 +163,116 @@ struct t_robustsession_ctx {
     GList *curl_handles;
 
     GCancellable *cancellable;
+    // Used instead of |cancellable| for PostMessage and DeleteSession
+    // requests waiting for an available target, which closing sessions still
+    // deliver, see robustsession_destroy().
+    GCancellable *send_cancellable;
 
     SERVER_REC *server;
+
+    // Referenced so that closing sessions can still send requests after the
+    // server was freed.
+    SERVER_CONNECT_REC *connrec;
+
+    // Set by robustsession_destroy(). The session is freed once its last
+    // PostMessage and the DeleteSession request completed, see
+    // session_close_progress().
+    bool closing;
+    bool delete_started;
+    bool delete_done;
+
+    // g_get_monotonic_time() when the session was created.
+    gint64 connect_start;
+
+    // Outgoing lines (struct send_ctx) which were not yet handed to libcurl.
+    GQueue *send_queue;
+    // Outgoing lines which were written while there was no session (before
+    // CreateSession completed, or while a lost session is re-established) or
+    // while the network of a session restored by /upgrade is being resolved.
+    // Flushed in one ordered burst by presession_flush().
+    GQueue *presession;
+    // Set by robustsession_restore() until robustsession_restore_resolved().
+    bool restoring;
+    // Number of lines at the head of |send_queue| which send_pump() starts
+    // regardless of the congestion window.
+    guint burst;
+    // Number of queued lines per send_classes entry which were dropped since
+    // the last report, see send_shed_report().
+    guint shed[SEND_CLASSES];
+
+    // AIMD congestion control for PostMessages: at most |cwnd| requests are
+    // in flight. The window grows by one per round trip while the latency
+    // stays near |rtt_base| and halves on rising latency or errors.
+    guint inflight;
+    double cwnd;
+    gint64 rtt_base;
+    gint64 rtt_srtt;
+    gint64 last_decrease;
+
+    // Token bucket which paces PostMessages, see send_pace(). |pace_rate| is
+    // in lines per second, 0 means unlimited.
+    double pace_rate;
+    double pace_tokens;
+    gint64 pace_last;
+    guint pace_tag;
+
+    // Outgoing lines are coalesced for |coalesce_window| microseconds before
+    // they are handed to send_pump(), see coalesce_arrival(). |send_gap| is
+    // the smoothed time between two lines.
+    gint64 last_arrival;
+    gint64 send_gap;
+    gint64 coalesce_window;
+    guint coalesce_tag;
+    guint coalesce_lines;
+
+    // Number of consecutive attempts to re-establish a lost session, see
+    // session_recover(). Reset once the new session delivers messages.
+    int recover_attempt;
+    guint recover_tag;
+    // Set by session_replay() until the new session is registered. Meanwhile,
+    // all lines but the registration go to |presession|, and |replay_tag|
+    // retries the NICK which the lost session might still hold.
+    bool replaying;
+    guint replay_tag;
+
+    // Fails the connection attempt from the main loop, see
+    // robustsession_connect().
+    guint connect_failed_tag;
+
+    // Set once the session was handed over to the next irssi process by
+    // /upgrade, see robustsession_save().
+    bool detached;
+
+    // Lines which were in flight when the session was saved, as
+    // “<ClientMessageId> <line>”. Re-sent once the network is resolved.
+    gchar **restored_pending;
+
+    // The targets which the latest GetMessages and PostMessage requests were
+    // sent to, used by the robustirc_placement policy.
+    gchar *read_target;
+    gchar *write_target;
+
+    // Lines awaiting their echo (struct echo_probe), oldest first.
+    GQueue *echo_probes;
+
+    // Lowercase names of the channels which irssi joined while connecting
+    // and whose JOIN was not yet echoed, see echo_probe_received(). NULL once
+    // all of them were joined (or after echo_probe_timeout).
+    GHashTable *joins;
+
+    // The GetMessages request which is being replaced by a new one, see
+    // session_migrate(). It is aborted once the new request delivers data.
+    CURL *gm_draining;
+    guint gm_break_tag;
+
+    // Ends the lifetime of the current GetMessages request, see
+    // stream_rebalance_cb().
+    guint rebalance_tag;
+
+    // Id of the latest message passed to irssi. Messages with a lower Id are
+    // duplicates, e.g. delivered by both GetMessages requests of a migration.
+    uint64_t delivered_id;
+    uint64_t delivered_reply;
 };
 
 struct t_body_buffer {
@@ -74,6 +287,7 @@ struct t_robustirc_request {
         RT_DELETESESSION = 1,
         RT_POSTMESSAGE = 2,
         RT_GETMESSAGES = 3,
+        RT_PROBE = 4,
     } type;
 
     char curl_error_buf[CURL_ERROR_SIZE];
@@ -82,7 +296,7 @@ struct t_robustirc_request {
     char *target;
 
     // Do not free. Used to prolong the GetMessages timeout when receiving a
-    // RobustPing message.
+    // RobustPing message and to clean up the request in request_free().
     CURL *curl;
 
     // |url_suffix| contains the part of the URL after the host:port, so that
@@ -92,9 +306,664 @@ struct t_robustirc_request {
     SERVER_REC *server;
     struct t_body_buffer *body;
 
+    // Used when type == RT_POSTMESSAGE, so that robustsession_save() can hand
+    // messages which are still in flight to the next irssi process.
+    char *line;
+    guint msgid;
+    // The JSON body which libcurl sends (without copying it).
+    char *post_body;
+    // g_get_monotonic_time() when the request was started, 0 after a retry.
+    gint64 start;
+
+    // Used when type == RT_PROBE: the network which |target| belongs to.
+    char *address;
+
     // Used when type == RT_GETMESSAGES.
     guint timeout_tag;
+    // g_get_monotonic_time() of the latest RobustPing, or 0.
+    gint64 last_ping;
+    struct t_robustsession_ctx *ctx;
+    struct gm_stream *stream;
+    // Messages of the chunk which is currently being parsed, separated by
+    // newlines, see gm_write_func().
+    GString *batch;
+};
+
+struct send_ctx {
+    char *buffer;
+    guint msgid;
     struct t_robustsession_ctx *ctx;
+    // Index into send_classes, or -1.
+    int class;
+    // g_get_monotonic_time() after which the line is dropped instead of
+    // sent, or 0.
+    gint64 deadline;
+};
+
+static void send_ctx_free(gpointer data) {
+    struct send_ctx *send_ctx = data;
+    free(send_ctx->buffer);
+    free(send_ctx);
+}
+
+static void echo_probe_free(gpointer data) {
+    struct echo_probe *probe = data;
+    g_free(probe->key);
+    g_free(probe);
+}
+
+static void get_messages(const char *target, gpointer userdata);
+static void stream_rebalance_arm(struct t_robustsession_ctx *ctx);
+static gboolean get_messages_timeout(gpointer userdata);
+static void robustsession_connect_target(const char *target, gpointer userdata);
+static void send_pump(struct t_robustsession_ctx *ctx);
+static void retry_request(const char *target, gpointer userdata);
+static void session_close_progress(struct t_robustsession_ctx *ctx);
+static void send_pace_throttled(struct t_robustsession_ctx *ctx);
+static void send_pace_delivered(struct t_robustsession_ctx *ctx);
+static void presession_flush(struct t_robustsession_ctx *ctx);
+static void replay_received(struct t_robustsession_ctx *ctx, const char *line);
+static struct gm_stream *gm_stream_new(struct t_robustirc_request *request);
+static void gm_stream_release(struct gm_stream *stream);
+static void session_migrate(struct t_robustsession_ctx *ctx);
+static void curl_set_common_options(CURL *curl,
+                                    struct t_robustsession_ctx *ctx,
+                                    SERVER_CONNECT_REC *conn,
+                                    struct t_robustirc_request *request);
+
+static CURLM *request_multi(struct t_robustirc_request *request) {
+    switch (request->type) {
+        case RT_GETMESSAGES:
+            return curl_handle_gm;
+        case RT_PROBE:
+            return curl_handle_probe;
+        default:
+            return curl_handle;
+    }
+}
+
+// Returns the timers entry of |multi|.
+static size_t timer_index(CURLM *multi) {
+    if (multi == curl_handle_gm) {
+        return 1;
+    }
+    return (multi == curl_handle_probe ? 2 : 0);
+}
+
+// Frees |request| including its curl handle. The curl handle must no longer
+// be part of any multi handle.
+static void request_free(struct t_robustirc_request *request) {
+    if (request->type == RT_GETMESSAGES && request->timeout_tag != 0) {
+        g_source_remove(request->timeout_tag);
+    }
+    curl_easy_cleanup(request->curl);
+    if (request->stream) {
+        gm_stream_release(request->stream);
+    }
+    free(request->line);
+    g_free(request->post_body);
+    free(request->body->body);
+    free(request->body);
+    free(request->target);
+    free(request->url_suffix);
+    free(request->address);
+    if (request->batch) {
+        g_string_free(request->batch, TRUE);
+    }
+    free(request);
+}
+
+static void gm_break_cancel(struct t_robustsession_ctx *ctx) {
+    if (ctx->gm_break_tag != 0) {
+        g_source_remove(ctx->gm_break_tag);
+        ctx->gm_break_tag = 0;
+    }
+    ctx->gm_draining = NULL;
+}
+
+// Aborts all currently running requests of |ctx|.
+static void abort_requests(struct t_robustsession_ctx *ctx) {
+    gm_break_cancel(ctx);
+    for (GList *h = ctx->curl_handles; h; h = h->next) {
+        CURL *curl = h->data;
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
+        curl_multi_remove_handle(request_multi(request), curl);
+        request_free(request);
+    }
+    g_list_free(ctx->curl_handles);
+    ctx->curl_handles = NULL;
+}
+
+static void session_free(struct t_robustsession_ctx *ctx) {
+    sessions = g_list_remove(sessions, ctx);
+    // Aborts a DeleteSession which might still wait for an available target.
+    g_cancellable_cancel(ctx->cancellable);
+    g_object_unref(ctx->cancellable);
+    g_cancellable_cancel(ctx->send_cancellable);
+    g_object_unref(ctx->send_cancellable);
+    if (ctx->recover_tag != 0) {
+        g_source_remove(ctx->recover_tag);
+    }
+    if (ctx->replay_tag != 0) {
+        g_source_remove(ctx->replay_tag);
+    }
+    if (ctx->connect_failed_tag != 0) {
+        g_source_remove(ctx->connect_failed_tag);
+    }
+    if (ctx->coalesce_tag != 0) {
+        g_source_remove(ctx->coalesce_tag);
+    }
+    if (ctx->pace_tag != 0) {
+        g_source_remove(ctx->pace_tag);
+    }
+    if (ctx->rebalance_tag != 0) {
+        g_source_remove(ctx->rebalance_tag);
+    }
+    gm_break_cancel(ctx);
+    g_free(ctx->sessionid);
+    g_free(ctx->sessionauth);
+    g_free(ctx->lastseen);
+    curl_slist_free_all(ctx->headers);
+    g_strfreev(ctx->restored_pending);
+    g_queue_free_full(ctx->send_queue, send_ctx_free);
+    g_queue_free_full(ctx->presession, send_ctx_free);
+    g_queue_free_full(ctx->echo_probes, echo_probe_free);
+    if (ctx->joins != NULL) {
+        g_hash_table_destroy(ctx->joins);
+    }
+    g_free(ctx->read_target);
+    g_free(ctx->write_target);
+    server_connect_unref(ctx->connrec);
+    g_free(ctx);
+}
+
+// Places a GetMessages (|write| is false) or PostMessage request according to
+// the robustirc_placement policy, see robustsession_network_server_placed().
+static gboolean session_place(struct t_robustsession_ctx *ctx,
+                              bool write,
+                              robustsession_network_server_cb callback,
+                              gpointer userdata) {
+    return robustsession_network_server_placed(
+        ctx->connrec->address,
+        write,
+        (write ? ctx->read_target : ctx->write_target),
+        (write ? ctx->send_cancellable : ctx->cancellable),
+        callback,
+        userdata);
+}
+
+static void session_set_target(gchar **dest, const char *target) {
+    g_free(*dest);
+    *dest = g_strdup(target);
+}
+
+// Returns the key under which |line| is matched with its echo, e.g.
+// “JOIN #robustirc”, or NULL if the IRC server does not echo such lines. If
+// |line| has a prefix, its nickname is stored in |nick|.
+static gchar *echo_key(const char *line, gchar **nick) {
+    gchar **tokens = g_strsplit_set(line, " \r\n", -1);
+    gchar *key = NULL;
+    int i = 0;
+    while (tokens[i] != NULL && *tokens[i] == '\0') {
+        i++;
+    }
+    if (tokens[i] != NULL && *tokens[i] == ':') {
+        if (nick != NULL) {
+            *nick = g_strndup(tokens[i] + 1, strcspn(tokens[i] + 1, "!@"));
+        }
+        i++;
+    }
+    const char *command = tokens[i];
+    const char *param = NULL;
+    if (command != NULL) {
+        for (i++; tokens[i] != NULL && *tokens[i] == '\0'; i++) {
+        }
+        param = tokens[i];
+    }
+    if (command != NULL && param != NULL &&
+        (g_ascii_strcasecmp(command, "JOIN") == 0 ||
+         g_ascii_strcasecmp(command, "PART") == 0 ||
+         g_ascii_strcasecmp(command, "NICK") == 0 ||
+         g_ascii_strcasecmp(command, "TOPIC") == 0)) {
+        gchar *upper = g_ascii_strup(command, -1);
+        gchar *lower = g_ascii_strdown(param + (*param == ':'), -1);
+        key = g_strdup_printf("%s %s", upper, lower);
+        g_free(upper);
+        g_free(lower);
+    }
+    g_strfreev(tokens);
+    return key;
+}
+
+// Starts measuring the echo latency of |line| if the IRC server echoes it.
+// Called when the PostMessage is handed to libcurl, so that the time |line|
+// spent in the send queue (coalescing, pacing) is not counted.
+static void echo_probe_sent(struct t_robustsession_ctx *ctx, const char *line) {
+    gchar *key = echo_key(line, NULL);
+    if (key == NULL) {
+        return;
+    }
+    if (ctx->joins != NULL && g_str_has_prefix(key, "JOIN ")) {
+        gchar **channels = g_strsplit(key + strlen("JOIN "), ",", -1);
+        for (gchar **c = channels; *c; c++) {
+            g_hash_table_add(ctx->joins, g_strdup(*c));
+        }
+        g_strfreev(channels);
+    }
+    if (g_queue_get_length(ctx->echo_probes) >= echo_probes_max) {
+        echo_probe_free(g_queue_pop_head(ctx->echo_probes));
+    }
+    struct echo_probe *probe = g_new0(struct echo_probe, 1);
+    probe->key = key;
+    probe->sent = g_get_monotonic_time();
+    probe->placement = robustsession_network_get_placement();
+    g_queue_push_tail(ctx->echo_probes, probe);
+}
+
+// Completes the echo probe which |line| (received from the network) answers.
+static void echo_probe_received(struct t_robustsession_ctx *ctx, const char *line) {
+    if ((g_queue_is_empty(ctx->echo_probes) && ctx->joins == NULL) || ctx->server == NULL) {
+        return;
+    }
+    const gint64 now = g_get_monotonic_time();
+    if (ctx->joins != NULL && now - ctx->connect_start > echo_probe_timeout) {
+        // Some JOIN failed, e.g. because of a ban.
+        g_hash_table_destroy(ctx->joins);
+        ctx->joins = NULL;
+    }
+    struct echo_probe *oldest;
+    while ((oldest = g_queue_peek_head(ctx->echo_probes)) != NULL &&
+           now - oldest->sent > echo_probe_timeout) {
+        echo_probe_free(g_queue_pop_head(ctx->echo_probes));
+    }
+
+    gchar *nick = NULL;
+    gchar *key = echo_key(line, &nick);
+    if (key != NULL && nick != NULL && ctx->server->nick != NULL &&
+        g_ascii_strcasecmp(nick, ctx->server->nick) == 0) {
+        if (ctx->joins != NULL && g_str_has_prefix(key, "JOIN ") &&
+            g_hash_table_remove(ctx->joins, key + strlen("JOIN ")) &&
+            g_hash_table_size(ctx->joins) == 0) {
+            gchar *ms = g_strdup_printf("%.1f", (now - ctx->connect_start) / 1000.0);
+            printformat_module(MODULE_NAME, ctx->server, NULL,
+                               MSGLEVEL_CRAP, ROBUSTIRCTXT_SESSION_JOINED, ms);
+            g_free(ms);
+            g_hash_table_destroy(ctx->joins);
+            ctx->joins = NULL;
+        }
+        for (GList *l = ctx->echo_probes->head; l; l = l->next) {
+            struct echo_probe *probe = l->data;
+            if (strcmp(probe->key, key) != 0) {
+                continue;
+            }
+            const gint64 latency = now - probe->sent;
+            echo_stats[probe->placement].count++;
+            echo_stats[probe->placement].sum += latency;
+            echo_stats[probe->placement].max = MAX(echo_stats[probe->placement].max, latency);
+            echo_probe_free(probe);
+            g_queue_delete_link(ctx->echo_probes, l);
+            break;
+        }
+    }
+    g_free(nick);
+    g_free(key);
+}
+
+// Applies a change of the target state of network |address| to all of its
+// sessions.
+static void network_changed(const char *address) {
+    for (GList *l = sessions; l; l = l->next) {
+        struct t_robustsession_ctx *ctx = l->data;
+        if (g_ascii_strcasecmp(ctx->connrec->address, address) == 0) {
+            session_migrate(ctx);
+        }
+    }
+}
+
+static gboolean network_changed_cb(gpointer userdata) {
+    gchar *address = userdata;
+    const gint64 start = robustsession_lag_enter();
+    network_changed(address);
+    g_free(address);
+    robustsession_lag_leave("network_changed_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Like network_changed(), but from the main loop, as requests cannot be
+// started from within libcurl callbacks.
+static void network_changed_later(const char *address) {
+    g_idle_add(network_changed_cb, g_strdup(address));
+}
+
+// Stops (|drain| is true) or resumes sending new requests to |target| of
+// network |address| and moves running GetMessages requests off |target|.
+void robustsession_drain(const char *address, const char *target, bool drain) {
+    if (!robustsession_network_drain(address, target, drain)) {
+        printformat_module(MODULE_NAME, NULL, NULL,
+                           MSGLEVEL_CLIENTERROR, ROBUSTIRCTXT_TARGET_UNKNOWN,
+                           address, target);
+        return;
+    }
+    printformat_module(MODULE_NAME, NULL, NULL,
+                       MSGLEVEL_CLIENTNOTICE, ROBUSTIRCTXT_TARGET_STATE,
+                       address, target, (drain ? "drained" : "undrained"));
+    network_changed(address);
+}
+
+// Sends all requests for network |address| to |target|, or picks targets as
+// usual again if |target| is NULL.
+void robustsession_pin(const char *address, const char *target) {
+    if (!robustsession_network_pin(address, target)) {
+        printformat_module(MODULE_NAME, NULL, NULL,
+                           MSGLEVEL_CLIENTERROR, ROBUSTIRCTXT_TARGET_UNKNOWN,
+                           address, (target ? target : ""));
+        return;
+    }
+    printformat_module(MODULE_NAME, NULL, NULL,
+                       MSGLEVEL_CLIENTNOTICE, ROBUSTIRCTXT_TARGET_STATE,
+                       address, (target ? target : "*"), (target ? "pinned" : "unpinned"));
+    network_changed(address);
+}
+
+// Prints the echo latency for every placement policy which was used, the
+// probed latency of every target and the filter counters.
+void robustsession_print_stats(void) {
+    for (int i = 0; i < ROBUSTSESSION_PLACEMENT_COUNT; i++) {
+        if (echo_stats[i].count == 0) {
+            continue;
+        }
+        gchar *count = g_strdup_printf("%u", echo_stats[i].count);
+        gchar *avg = g_strdup_printf("%.1f", echo_stats[i].sum / 1000.0 / echo_stats[i].count);
+        gchar *max = g_strdup_printf("%.1f", echo_stats[i].max / 1000.0);
+        printformat_module(MODULE_NAME, NULL, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_STATS_ECHO,
+                           robustsession_network_placement_name(i), count, avg, max);
+        g_free(count);
+        g_free(avg);
+        g_free(max);
+    }
+    if (coalesce_stats.flushes > 0) {
+        GString *batches = g_string_new(NULL);
+        for (int i = 0; i < COALESCE_BUCKETS; i++) {
+            if (coalesce_stats.batches[i] == 0) {
+                continue;
+            }
+            g_string_append_printf(batches, " %s%u:%" G_GUINT64_FORMAT,
+                                   (i == COALESCE_BUCKETS - 1 ? "≥" : ""), 1u << i,
+                                   coalesce_stats.batches[i]);
+        }
+        gchar *flushes = g_strdup_printf("%" G_GUINT64_FORMAT, coalesce_stats.flushes);
+        gchar *avg = g_strdup_printf("%.1f", coalesce_stats.window_sum / 1000.0 / coalesce_stats.flushes);
+        gchar *max = g_strdup_printf("%.1f", coalesce_stats.window_max / 1000.0);
+        printformat_module(MODULE_NAME, NULL, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_STATS_COALESCE,
+                           flushes, avg, max, batches->str);
+        g_free(flushes);
+        g_free(avg);
+        g_free(max);
+        g_string_free(batches, TRUE);
+    }
+    robustsession_network_print_stats();
+    robustsession_filter_print_stats();
+    robustsession_lag_print_stats();
+}
+
+// Aborts the GetMessages request which the request started by
+// session_migrate() replaces. libcurl handles must not be removed from within
+// libcurl callbacks, hence this runs from the main loop.
+static gboolean gm_break_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    const gint64 start = robustsession_lag_enter();
+    CURL *curl = ctx->gm_draining;
+    ctx->gm_break_tag = 0;
+    ctx->gm_draining = NULL;
+    if (curl != NULL) {
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
+        curl_multi_remove_handle(curl_handle_gm, curl);
+        ctx->curl_handles = g_list_remove(ctx->curl_handles, curl);
+        request_free(request);
+    }
+    robustsession_lag_leave("gm_break_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// robustsession_network_server_cb which starts the GetMessages request that
+// replaces ctx->gm_draining, see session_migrate().
+static void session_migrate_to(const char *target, gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    if (ctx->gm_draining != NULL) {
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(ctx->gm_draining, CURLINFO_PRIVATE, &request);
+        if (g_ascii_strcasecmp(request->target, target) == 0) {
+            // No other target is available. As curl_handle_gm allows only one
+            // connection per host, a new request would wait for the old one
+            // to end, so keep the old one instead.
+            ctx->gm_draining = NULL;
+            return;
+        }
+    }
+    get_messages(target, ctx);
+}
+
+// Moves the GetMessages request of |ctx| off its target if that target was
+// drained, quarantined or another target was pinned. The new request is
+// started on another target before the old one is aborted, so that no
+// messages are delayed. If no other target is available, the old request
+// stays.
+static void session_migrate(struct t_robustsession_ctx *ctx) {
+    if (ctx->closing || ctx->sessionid == NULL || ctx->gm_draining != NULL) {
+        return;
+    }
+    for (GList *h = ctx->curl_handles; h; h = h->next) {
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(h->data, CURLINFO_PRIVATE, &request);
+        if (request->type != RT_GETMESSAGES ||
+            robustsession_network_target_usable(ctx->connrec->address, request->target)) {
+            continue;
+        }
+        ctx->gm_draining = request->curl;
+        session_place(ctx, false, session_migrate_to, ctx);
+        return;
+    }
+}
+
+// Moves the GetMessages request of |ctx| to the target picked by
+// robustsession_network_rebalance() once its lifetime
+// (robustirc_stream_lifetime) is over. That target is never the current one,
+// so the new request does not queue behind the old one on curl_handle_gm and
+// the move is make-before-break like session_migrate(). Without this, streams stay on the node they landed on
+// until it fails, e.g. all on the node which restarted first during a rolling
+// restart.
+static gboolean stream_rebalance_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    const gint64 start = robustsession_lag_enter();
+    ctx->rebalance_tag = 0;
+    if (ctx->closing || ctx->sessionid == NULL || ctx->gm_draining != NULL) {
+        // A new request is being started, which sets up a new lifetime.
+        robustsession_lag_leave("stream_rebalance_cb", start);
+        return G_SOURCE_REMOVE;
+    }
+    for (GList *h = ctx->curl_handles; h; h = h->next) {
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(h->data, CURLINFO_PRIVATE, &request);
+        if (request->type != RT_GETMESSAGES) {
+            continue;
+        }
+        const char *target = robustsession_network_rebalance(
+            ctx->connrec->address, request->target, ctx->write_target);
+        if (target != NULL) {
+            ctx->gm_draining = request->curl;
+            get_messages(target, ctx);
+        } else {
+            stream_rebalance_arm(ctx);
+        }
+        break;
+    }
+    robustsession_lag_leave("stream_rebalance_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Starts the lifetime of a new GetMessages request: robustirc_stream_lifetime
+// ± 25%, so that sessions which (re-)connected at the same time do not all
+// move at once.
+static void stream_rebalance_arm(struct t_robustsession_ctx *ctx) {
+    if (ctx->rebalance_tag != 0) {
+        g_source_remove(ctx->rebalance_tag);
+        ctx->rebalance_tag = 0;
+    }
+    const int lifetime = settings_get_time("robustirc_stream_lifetime");
+    if (lifetime <= 0) {
+        return;
+    }
+    const guint jittered = (guint)(lifetime * g_random_double_range(0.75, 1.25));
+    ctx->rebalance_tag = g_timeout_add(jittered, stream_rebalance_cb, ctx);
+}
+
+// Replaces all requests of |ctx| which might be stuck on connections that
+// silently died, e.g. after the local network changed: GetMessages is
+// restarted and PostMessages in flight are retried with the same
+// ClientMessageId.
+//
+// Unlike session_migrate(), the GetMessages request is aborted before the new
+// one is placed: the new request is likely placed on the same target, and as
+// curl_handle_gm allows only one connection per host, it would otherwise wait
+// for the dead connection.
+static void session_restart(struct t_robustsession_ctx *ctx) {
+    if (ctx->closing || ctx->sessionid == NULL) {
+        return;
+    }
+    gm_break_cancel(ctx);
+    // Retried requests are appended to ctx->curl_handles again.
+    GList *handles = g_list_copy(ctx->curl_handles);
+    bool restart_gm = false;
+    for (GList *h = handles; h; h = h->next) {
+        CURL *curl = h->data;
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
+        if (request->type == RT_GETMESSAGES) {
+            curl_multi_remove_handle(curl_handle_gm, curl);
+            ctx->curl_handles = g_list_remove(ctx->curl_handles, curl);
+            request_free(request);
+            restart_gm = true;
+        } else if (request->type == RT_POSTMESSAGE) {
+            curl_multi_remove_handle(curl_handle, curl);
+            ctx->curl_handles = g_list_remove(ctx->curl_handles, curl);
+            session_place(ctx, true, retry_request, curl);
+        }
+    }
+    g_list_free(handles);
+    if (restart_gm) {
+        session_place(ctx, false, get_messages, ctx);
+    }
+}
+
+static gboolean network_monitor_cb(gpointer userdata) {
+    (void)userdata;
+    const gint64 start = robustsession_lag_enter();
+    network_monitor_tag = 0;
+    if (g_network_monitor_get_network_available(network_monitor)) {
+        fresh_connect_until = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+        for (GList *l = sessions; l; l = l->next) {
+            session_restart(l->data);
+        }
+    }
+    robustsession_lag_leave("network_monitor_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Called by GNetworkMonitor (using netlink on Linux) when addresses or routes
+// change, e.g. when a laptop switches networks. Instead of waiting for
+// get_messages_timeout() to notice that the GetMessages connection died,
+// restarts all streams right away. Changes come in bursts, so the restart is
+// delayed until the configuration settled for a moment.
+//
+// GNetworkMonitor does not tell which routes changed, so every session on
+// every RobustIRC network is restarted, even those whose connections still
+// work. Each restart costs one GetMessages request and the retry of the
+// PostMessages in flight.
+static void network_monitor_changed(GNetworkMonitor *monitor, gboolean available, gpointer userdata) {
+    (void)monitor;
+    (void)available;
+    (void)userdata;
+    if (network_monitor_tag != 0) {
+        g_source_remove(network_monitor_tag);
+    }
+    network_monitor_tag = g_timeout_add(500, network_monitor_cb, NULL);
+}
+
+static void probe_round(void);
+
+// Returns the time the system spent suspended so far, in microseconds, or -1
+// if that cannot be determined. CLOCK_MONOTONIC (which glib timers use) stops
+// during suspend, CLOCK_BOOTTIME does not.
+static gint64 suspended_usec(void) {
+#ifdef CLOCK_BOOTTIME
+    struct timespec monotonic, boottime;
+    if (clock_gettime(CLOCK_MONOTONIC, &monotonic) != 0 ||
+        clock_gettime(CLOCK_BOOTTIME, &boottime) != 0) {
+        return -1;
+    }
+    return ((gint64)(boottime.tv_sec - monotonic.tv_sec) * G_USEC_PER_SEC +
+            (boottime.tv_nsec - monotonic.tv_nsec) / 1000);
+#else
+    return -1;
+#endif
+}
+
+// Detects that the system was suspended since the last call. After a resume,
+// the connections of all sessions are most likely dead, but glib timers
+// (including the GetMessages watchdog) continue as if no time passed, so
+// restart all streams with the current lastseen right away and probe all
+// targets in parallel to find out which ones are reachable.
+static void suspend_check(void) {
+    const gint64 offset = suspended_usec();
+    if (offset == -1) {
+        return;
+    }
+    const gint64 suspended = offset - suspend_offset;
+    const bool resumed = (suspend_offset != -1 && suspended > G_USEC_PER_SEC);
+    suspend_offset = offset;
+    if (!resumed) {
+        return;
+    }
+    gchar *seconds = g_strdup_printf("%" G_GINT64_FORMAT, suspended / G_USEC_PER_SEC);
+    printformat_module(MODULE_NAME, NULL, NULL,
+                       MSGLEVEL_CLIENTNOTICE, ROBUSTIRCTXT_RESUMED, seconds);
+    g_free(seconds);
+    fresh_connect_until = g_get_monotonic_time() + 10 * G_USEC_PER_SEC;
+    for (GList *l = sessions; l; l = l->next) {
+        session_restart(l->data);
+    }
+    if (probes == NULL) {
+        probe_round();
+    }
+}
+
+static gboolean suspend_cb(gpointer userdata) {
+    (void)userdata;
+    const gint64 start = robustsession_lag_enter();
+    suspend_check();
+    robustsession_lag_leave("suspend_cb", start);
+    return G_SOURCE_CONTINUE;
+}
+
+// A message parsed from a GetMessages response.
+struct gm_message {
+    uint64_t id;
+    uint64_t reply;
+    long type;
+    char *data;
+    GQueue *servers;
+};
+
+// Parser state of a GetMessages response. Chunks are parsed either directly
+// in gm_write_func() or, with robustirc_parse_threads > 0, on a worker thread.
+// Each stream sticks to one worker (its shard) so that its chunks are parsed
+// in order, and new streams go to the least busy worker.
+struct gm_stream {
+    gint refcount;
     yajl_handle parser;
     char *last_key;
     char *data;
@@ -105,201 +974,503 @@ struct t_robustirc_request {
     long last_type;
     int depth;
     GQueue *servers;
+    // Messages parsed from the current chunk.
+    GPtrArray *messages;
+    GThreadPool *shard;
+
+    // Only accessed on the main thread. NULL once the request was freed or
+    // retried, so that messages which are still being parsed are dropped.
+    struct t_robustirc_request *request;
 };
 
-static void get_messages(const char *target, gpointer userdata);
-static gboolean get_messages_timeout(gpointer userdata);
-static void curl_set_common_options(CURL *curl,
-                                    struct t_robustsession_ctx *ctx,
-                                    SERVER_REC *server,
-                                    struct t_robustirc_request *request);
+// A chunk which a worker thread parsed, see gm_results_dispatch().
+struct gm_result {
+    struct gm_stream *stream;
+    GPtrArray *messages;
+    gchar *error_chunk;
+    gchar *error;
+};
 
-// Feeds messages such as the following into the JSON parser:
-//
-// {"Id":     {"Id":1428773900924989332,"Reply":1},
-//  "Session":{"Id":1428773900606543398,"Reply":0},
-//  "Type":   3,
-//  "Data":   ":robustirc.net 311 sECuRE blorgh michael robust/0x13d4059e24c28428 * :Michael Stapelberg"}
-//
-// or (a ping message):
-//
-// {"Id":     {"Id":0,"Reply":0},
-//  "Session":{"Id":0,"Reply":0},
-//  "Type":   4,
-//  "Data":   "",
-//  "Servers":["localhost:13003","localhost:13001","localhost:13002"]}
-static size_t
-gm_write_func(void *ptr, size_t size, size_t nmemb, void *userdata) {
-    struct t_robustirc_request *request = userdata;
-    // We can safely multiply size * nmemb without overflow checking because
-    // curl_easy_setopt(3), section CURLOPT_WRITEFUNCTION specifies that (size
-    // * nmemb) < CURL_MAX_WRITE_SIZE == 16 KiB.
-    if (yajl_parse(request->parser, ptr, size * nmemb) != yajl_status_ok) {
-        unsigned char *yajl_error =
-            yajl_get_error(request->parser, 0, ptr, size * nmemb);
-        gchar *chunk = g_strdup(ptr);
-        gchar *error = g_strdup((const char *)yajl_error);
-        g_strstrip(chunk);
-        g_strstrip(error);
-        printformat_module(MODULE_NAME, request->server, NULL,
-                           MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_PARSE_JSON,
-                           chunk, error);
-        g_free(chunk);
-        g_free(error);
-        yajl_free_error(request->parser, yajl_error);
+// Worker threads for parsing (robustirc_parse_threads, empty if 0) and the
+// queue of struct gm_result for the main thread.
+static GPtrArray *gm_shards;
+static GAsyncQueue *gm_results;
+static gint gm_results_scheduled;
+
+static void gm_message_free(gpointer data) {
+    struct gm_message *message = data;
+    free(message->data);
+    if (message->servers) {
+        g_queue_free_full(message->servers, g_free);
     }
-    return size * nmemb;
+    g_free(message);
+}
+
+static void gm_stream_unref(struct gm_stream *stream) {
+    if (!g_atomic_int_dec_and_test(&stream->refcount)) {
+        return;
+    }
+    yajl_free(stream->parser);
+    if (stream->servers) {
+        g_queue_free_full(stream->servers, g_free);
+    }
+    free(stream->last_key);
+    free(stream->data);
+    g_ptr_array_free(stream->messages, TRUE);
+    g_free(stream);
+}
+
+// Detaches |stream| from its request, which is being freed or retried.
+static void gm_stream_release(struct gm_stream *stream) {
+    stream->request = NULL;
+    gm_stream_unref(stream);
 }
 
 static int gm_json_map_key(void *ctx, const unsigned char *val, size_t len) {
-    struct t_robustirc_request *request = ctx;
+    struct gm_stream *stream = ctx;
 
-    free(request->last_key);
-    request->last_key = g_new0(char, len + 1);
-    memcpy(request->last_key, val, len);
+    free(stream->last_key);
+    stream->last_key = g_new0(char, len + 1);
+    memcpy(stream->last_key, val, len);
 
     return 1;
 }
 
 static int gm_json_integer(void *ctx, long long val) {
-    struct t_robustirc_request *request = ctx;
-    if (!request->last_key) {
+    struct gm_stream *stream = ctx;
+    if (!stream->last_key) {
         return 1;
     }
-    if (request->parsing_id) {
-        if (strcasecmp(request->last_key, "id") == 0) {
-            request->last_id_id = (uint64_t)val;
-        } else if (strcasecmp(request->last_key, "reply") == 0) {
-            request->last_id_reply = (uint64_t)val;
+    if (stream->parsing_id) {
+        if (strcasecmp(stream->last_key, "id") == 0) {
+            stream->last_id_id = (uint64_t)val;
+        } else if (strcasecmp(stream->last_key, "reply") == 0) {
+            stream->last_id_reply = (uint64_t)val;
         }
     }
-    if (strcasecmp(request->last_key, "type") == 0) {
-        request->last_type = val;
+    if (strcasecmp(stream->last_key, "type") == 0) {
+        stream->last_type = val;
     }
     return 1;
 }
 
 static int gm_json_string(void *ctx, const unsigned char *val, size_t len) {
-    struct t_robustirc_request *request = ctx;
-    if (request->parsing_servers) {
+    struct gm_stream *stream = ctx;
+    if (stream->parsing_servers) {
         char *str = g_new0(char, len + 1);
         memcpy(str, val, len);
-        g_queue_push_tail(request->servers, str);
+        g_queue_push_tail(stream->servers, str);
+        return 1;
+    }
+    if (!stream->last_key) {
+        return 1;
+    }
+    if (strcasecmp(stream->last_key, "data") == 0) {
+        free(stream->data);
+        stream->data = g_new0(char, len + 1);
+        memcpy(stream->data, val, len);
+    }
+    return 1;
+}
+
+static int gm_json_start_array(void *ctx) {
+    struct gm_stream *stream = ctx;
+
+    if (stream->last_key && strcasecmp(stream->last_key, "servers") == 0) {
+        stream->parsing_servers = true;
+        if (stream->servers) {
+            g_queue_free_full(stream->servers, g_free);
+        }
+        stream->servers = g_queue_new();
+    }
+    return 1;
+}
+
+static int gm_json_end_array(void *ctx) {
+    struct gm_stream *stream = ctx;
+    stream->parsing_servers = false;
+    return 1;
+}
+
+static int gm_json_start_map(void *ctx) {
+    struct gm_stream *stream = ctx;
+    stream->parsing_id =
+        (stream->last_key && strcasecmp(stream->last_key, "id") == 0);
+    stream->depth++;
+    return 1;
+}
+
+static int gm_json_end_map(void *ctx) {
+    struct gm_stream *stream = ctx;
+    stream->parsing_id = false;
+    stream->depth--;
+    if (stream->depth > 0) {
         return 1;
     }
-    if (!request->last_key) {
-        return 1;
+    struct gm_message *message = g_new0(struct gm_message, 1);
+    message->id = stream->last_id_id;
+    message->reply = stream->last_id_reply;
+    message->type = stream->last_type;
+    message->data = stream->data;
+    stream->data = NULL;
+    if (stream->last_type == robustping) {
+        message->servers = stream->servers;
+        stream->servers = NULL;
+    }
+    g_ptr_array_add(stream->messages, message);
+    return 1;
+}
+
+static yajl_callbacks gm_callbacks = {
+    NULL,
+    NULL,
+    gm_json_integer,
+    NULL,
+    NULL,
+    gm_json_string,
+    gm_json_start_map,
+    gm_json_map_key,
+    gm_json_end_map,
+    gm_json_start_array,
+    gm_json_end_array};
+
+static struct gm_stream *gm_stream_new(struct t_robustirc_request *request) {
+    struct gm_stream *stream = g_new0(struct gm_stream, 1);
+    stream->refcount = 1;
+    stream->request = request;
+    stream->messages = g_ptr_array_new_with_free_func(gm_message_free);
+    stream->parser = yajl_alloc(&gm_callbacks, NULL, stream);
+    yajl_config(stream->parser, yajl_allow_multiple_values, 1);
+    for (guint i = 0; gm_shards != NULL && i < gm_shards->len; i++) {
+        GThreadPool *shard = g_ptr_array_index(gm_shards, i);
+        if (stream->shard == NULL ||
+            g_thread_pool_unprocessed(shard) < g_thread_pool_unprocessed(stream->shard)) {
+            stream->shard = shard;
+        }
+    }
+    return stream;
+}
+
+// Parses |len| bytes of |chunk|, returning the parsed messages. On parse
+// errors, |error_chunk| and |error| describe the problem. Runs on any thread.
+static GPtrArray *gm_parse(struct gm_stream *stream, const unsigned char *chunk, size_t len,
+                           gchar **error_chunk, gchar **error) {
+    if (yajl_parse(stream->parser, chunk, len) != yajl_status_ok) {
+        unsigned char *yajl_error =
+            yajl_get_error(stream->parser, 0, chunk, len);
+        *error_chunk = g_strndup((const gchar *)chunk, len);
+        *error = g_strdup((const char *)yajl_error);
+        g_strstrip(*error_chunk);
+        g_strstrip(*error);
+        yajl_free_error(stream->parser, yajl_error);
+    }
+    GPtrArray *messages = stream->messages;
+    stream->messages = g_ptr_array_new_with_free_func(gm_message_free);
+    return messages;
+}
+
+// Passes |message| to irssi.
+static void gm_deliver(struct gm_stream *stream, struct gm_message *message) {
+    struct t_robustirc_request *request = stream->request;
+    // TODO: need to confirm the server is connected and has a rawlog, otherwise segfault
+    struct t_robustsession_ctx *session = request->ctx;
+    if (message->data != NULL && message->type == robustirc_to_client &&
+        (message->id < session->delivered_id ||
+         (message->id == session->delivered_id &&
+          message->reply <= session->delivered_reply))) {
+        // Already delivered.
+        free(message->data);
+        message->data = NULL;
+    }
+    if (message->data != NULL && message->type == robustirc_to_client) {
+        session->delivered_id = message->id;
+        session->delivered_reply = message->reply;
+        robustsession_tap_publish(message->id, message->reply, message->data);
+        rawlog_input(request->server->rawlog, message->data);
+        replay_received(request->ctx, message->data);
+        const robustsession_filter_action action =
+            robustsession_filter_match(request->server, message->data);
+        if (action != ROBUSTSESSION_FILTER_DROP) {
+            echo_probe_received(request->ctx, message->data);
+            if (request->batch == NULL) {
+                request->batch = g_string_new(NULL);
+            }
+            g_string_append(request->batch, message->data);
+            g_string_append_c(request->batch, '\n');
+            robustsession_filter_hide(action == ROBUSTSESSION_FILTER_HIDE);
+            signal_emit("server incoming", 2, request->server, message->data);
+            robustsession_filter_hide(false);
+            // The signal handlers might have disconnected the server.
+            if (stream->request == NULL) {
+                return;
+            }
+        }
+        free(request->ctx->lastseen);
+        request->ctx->lastseen = g_strdup_printf(
+            "%" PRIu64 ".%" PRIu64,
+            message->id,
+            message->reply);
+    }
+    if (message->type == robustping) {
+        const gint64 now = g_get_monotonic_time();
+        if (request->last_ping != 0) {
+            const gint64 interval = now - request->last_ping;
+            robustping_interval = (robustping_interval == 0 ? interval
+                                                            : (7 * robustping_interval + interval) / 8);
+        }
+        request->last_ping = now;
+        g_source_remove(request->timeout_tag);
+        request->timeout_tag = g_timeout_add_seconds(
+            60, get_messages_timeout, request->curl);
+        if (message->servers != NULL) {
+            const gboolean quarantined = robustsession_network_update_servers(
+                request->server->connrec->address, request->target, message->servers);
+            message->servers = NULL;
+            if (quarantined) {
+                network_changed_later(request->server->connrec->address);
+            }
+        }
+    }
+}
+
+// Passes the messages parsed from one chunk of |stream| to irssi.
+static void gm_deliver_chunk(struct gm_stream *stream, GPtrArray *messages,
+                             const gchar *error_chunk, const gchar *error) {
+    if (stream->request == NULL) {
+        return;
+    }
+    if (error != NULL) {
+        printformat_module(MODULE_NAME, stream->request->server, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_PARSE_JSON,
+                           error_chunk, error);
+    }
+    for (guint i = 0; i < messages->len && stream->request != NULL; i++) {
+        gm_deliver(stream, g_ptr_array_index(messages, i));
     }
-    if (strcasecmp(request->last_key, "data") == 0) {
-        free(request->data);
-        request->data = g_new0(char, len + 1);
-        memcpy(request->data, val, len);
+    struct t_robustirc_request *request = stream->request;
+    if (request != NULL && messages->len > 0) {
+        // Once per chunk rather than per message: this looks up and possibly
+        // updates the shared health table.
+        robustsession_network_succeeded(
+            request->server->connrec->address, request->target);
+        // The session delivers messages, so any recovery is complete.
+        request->ctx->recover_attempt = 0;
+    }
+    // Scripts which process traffic in bulk can handle all messages of the
+    // chunk at once instead of once per "server incoming" signal. Perl scripts
+    // need to register the signal using:
+    // Irssi::signal_register({'robustirc incoming batch' => [qw(iobject string)]});
+    if (request != NULL && request->batch != NULL && request->batch->len > 0) {
+        signal_emit("robustirc incoming batch", 2, request->server, request->batch->str);
+        if (stream->request != NULL) {
+            g_string_truncate(request->batch, 0);
+        }
     }
-    return 1;
 }
 
-static int gm_json_start_array(void *ctx) {
-    struct t_robustirc_request *request = ctx;
+static void gm_result_free(struct gm_result *result) {
+    gm_stream_unref(result->stream);
+    g_ptr_array_free(result->messages, TRUE);
+    g_free(result->error_chunk);
+    g_free(result->error);
+    g_free(result);
+}
 
-    if (request->last_key && strcasecmp(request->last_key, "servers") == 0) {
-        request->parsing_servers = true;
-        request->servers = g_queue_new();
+// Delivers the chunks which the worker threads parsed, in the order in which
+// they finished.
+static gboolean gm_results_dispatch(gpointer userdata) {
+    (void)userdata;
+    const gint64 start = robustsession_lag_enter();
+    g_atomic_int_set(&gm_results_scheduled, 0);
+    struct gm_result *result;
+    while ((result = g_async_queue_try_pop(gm_results)) != NULL) {
+        // Keep the stream alive in case the signal handlers free the request.
+        gm_deliver_chunk(result->stream, result->messages, result->error_chunk, result->error);
+        gm_result_free(result);
     }
-    return 1;
+    robustsession_lag_leave("gm_results_dispatch", start);
+    return G_SOURCE_REMOVE;
 }
 
-static int gm_json_end_array(void *ctx) {
-    struct t_robustirc_request *request = ctx;
-    request->parsing_servers = false;
-    return 1;
+struct gm_job {
+    struct gm_stream *stream;
+    GBytes *chunk;
+};
+
+// Runs on a worker thread.
+static void gm_parse_job(gpointer data, gpointer userdata) {
+    (void)userdata;
+    struct gm_job *job = data;
+    struct gm_result *result = g_new0(struct gm_result, 1);
+    gsize len;
+    const unsigned char *chunk = g_bytes_get_data(job->chunk, &len);
+    result->stream = job->stream;
+    result->messages = gm_parse(job->stream, chunk, len, &result->error_chunk, &result->error);
+    g_bytes_unref(job->chunk);
+    g_free(job);
+    g_async_queue_push(gm_results, result);
+    if (g_atomic_int_compare_and_exchange(&gm_results_scheduled, 0, 1)) {
+        g_idle_add(gm_results_dispatch, &gm_results_scheduled);
+    }
 }
 
-static int gm_json_start_map(void *ctx) {
-    struct t_robustirc_request *request = ctx;
-    request->parsing_id =
-        (request->last_key && strcasecmp(request->last_key, "id") == 0);
-    request->depth++;
-    return 1;
+static void gm_shards_init(void) {
+    const int threads = settings_get_int("robustirc_parse_threads");
+    gm_results = g_async_queue_new();
+    gm_shards = g_ptr_array_new();
+    for (int i = 0; i < threads; i++) {
+        GThreadPool *shard = g_thread_pool_new(gm_parse_job, NULL, 1, FALSE, NULL);
+        if (shard != NULL) {
+            g_ptr_array_add(gm_shards, shard);
+        }
+    }
 }
 
-static int gm_json_end_map(void *ctx) {
-    struct t_robustirc_request *request = ctx;
-    request->parsing_id = false;
-    request->depth--;
-    if (request->depth > 0) {
-        return 1;
+static void gm_shards_deinit(void) {
+    if (gm_shards == NULL) {
+        return;
     }
-    // TODO: need to confirm the server is connected and has a rawlog, otherwise segfault
-    if (request->data != NULL && request->last_type == robustirc_to_client) {
-        rawlog_input(request->server->rawlog, request->data);
-        signal_emit("server incoming", 2, request->server, request->data);
-        free(request->data);
-        request->data = NULL;
-        free(request->ctx->lastseen);
-        request->ctx->lastseen = g_strdup_printf(
-            "%" PRIu64 ".%" PRIu64,
-            request->last_id_id,
-            request->last_id_reply);
+    // Finish all queued jobs so that they do not leak.
+    for (guint i = 0; i < gm_shards->len; i++) {
+        g_thread_pool_free(g_ptr_array_index(gm_shards, i), FALSE, TRUE);
     }
-    if (request->last_type == robustping) {
-        g_source_remove(request->timeout_tag);
-        request->timeout_tag = g_timeout_add_seconds(
-            60, get_messages_timeout, request->curl);
-        robustsession_network_update_servers(
-            request->server->connrec->address, request->servers);
-        request->servers = NULL;
+    g_ptr_array_free(gm_shards, TRUE);
+    gm_shards = NULL;
+    g_source_remove_by_user_data(&gm_results_scheduled);
+    struct gm_result *result;
+    while ((result = g_async_queue_try_pop(gm_results)) != NULL) {
+        gm_result_free(result);
     }
-
-    robustsession_network_succeeded(
-        request->server->connrec->address, request->target);
-
-    return 1;
+    g_async_queue_unref(gm_results);
+    gm_results = NULL;
 }
 
-static yajl_callbacks gm_callbacks = {
-    NULL,
-    NULL,
-    gm_json_integer,
-    NULL,
-    NULL,
-    gm_json_string,
-    gm_json_start_map,
-    gm_json_map_key,
-    gm_json_end_map,
-    gm_json_start_array,
-    gm_json_end_array};
+// Feeds messages such as the following into the JSON parser:
+//
+// {"Id":     {"Id":1428773900924989332,"Reply":1},
+//  "Session":{"Id":1428773900606543398,"Reply":0},
+//  "Type":   3,
+//  "Data":   ":robustirc.net 311 sECuRE blorgh michael robust/0x13d4059e24c28428 * :Michael Stapelberg"}
+//
+// or (a ping message):
+//
+// {"Id":     {"Id":0,"Reply":0},
+//  "Session":{"Id":0,"Reply":0},
+//  "Type":   4,
+//  "Data":   "",
+//  "Servers":["localhost:13003","localhost:13001","localhost:13002"]}
+static size_t
+gm_write_func(void *ptr, size_t size, size_t nmemb, void *userdata) {
+    struct t_robustirc_request *request = userdata;
+    struct t_robustsession_ctx *ctx = request->ctx;
+    if (ctx->gm_draining != NULL && ctx->gm_draining != request->curl &&
+        ctx->gm_break_tag == 0) {
+        // The replacement request works, so the old one can go.
+        ctx->gm_break_tag = g_idle_add(gm_break_cb, ctx);
+    }
+    struct gm_stream *stream = request->stream;
+    // We can safely multiply size * nmemb without overflow checking because
+    // curl_easy_setopt(3), section CURLOPT_WRITEFUNCTION specifies that (size
+    // * nmemb) < CURL_MAX_WRITE_SIZE == 16 KiB.
+    if (stream->shard != NULL) {
+        struct gm_job *job = g_new0(struct gm_job, 1);
+        g_atomic_int_inc(&stream->refcount);
+        job->stream = stream;
+        job->chunk = g_bytes_new(ptr, size * nmemb);
+        g_thread_pool_push(stream->shard, job, NULL);
+        return size * nmemb;
+    }
+    gchar *error_chunk = NULL;
+    gchar *error = NULL;
+    GPtrArray *messages = gm_parse(stream, ptr, size * nmemb, &error_chunk, &error);
+    // Keep the stream alive in case the signal handlers free the request.
+    g_atomic_int_inc(&stream->refcount);
+    gm_deliver_chunk(stream, messages, error_chunk, error);
+    gm_stream_unref(stream);
+    g_ptr_array_free(messages, TRUE);
+    g_free(error_chunk);
+    g_free(error);
+    return size * nmemb;
+}
 
 static gboolean get_messages_timeout(gpointer userdata) {
     CURL *curl = userdata;
     struct t_robustirc_request *request = NULL;
+    const gint64 start = robustsession_lag_enter();
 
     curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
 
     gchar *address = NULL;
     if (request->server->connrec && request->server->connrec->address) {
         address = g_strdup(request->server->connrec->address);
-        robustsession_network_failed(address, request->target);
+        robustsession_network_failed(address, request->target, TRUE);
     }
 
     printtext(NULL, NULL, MSGLEVEL_CRAP, "get_messages_timeout");
 
     curl_multi_remove_handle(curl_handle_gm, curl);
     request->ctx->curl_handles = g_list_remove(request->ctx->curl_handles, curl);
-    curl_easy_cleanup(curl);
-    free(request->body->body);
-    free(request->body);
-    free(request->target);
+    // This source is being dispatched and will be removed once we return.
+    request->timeout_tag = 0;
     struct t_robustsession_ctx *ctx = request->ctx;
-    free(request);
+    request_free(request);
+
+    if (ctx->gm_draining == curl) {
+        // Being replaced already, see session_migrate().
+        gm_break_cancel(ctx);
+        g_free(address);
+        robustsession_lag_leave("get_messages_timeout", start);
+        return G_SOURCE_REMOVE;
+    }
 
     if (address) {
-        robustsession_network_server(address, TRUE, ctx->cancellable, get_messages, ctx);
+        session_place(ctx, false, get_messages, ctx);
         g_free(address);
     }
 
+    robustsession_lag_leave("get_messages_timeout", start);
     return G_SOURCE_REMOVE;
 }
 
+// libcurl callback which enables TCP keepalive on new GetMessages connections,
+// so that the kernel reports a dead peer (and check_multi_info() fails over)
+// long before get_messages_timeout() fires.
+//
+// Probing starts once the connection was idle for a quarter of the RobustPing
+// interval (between 1 and 5 seconds), with probes spaced a few round trips
+// apart. A probe only costs an empty segment, so probing between RobustPings
+// is cheap. A dead peer is detected after idle + count × interval, i.e.
+// within about 8 seconds for round trip times below 250ms. TCP_USER_TIMEOUT
+// bounds the time unacknowledged data (and unanswered probes) may take, so
+// that it does not fall back to the default of about 15 minutes of
+// retransmissions.
+static int gm_sockopt(void *clientp, curl_socket_t fd, curlsocktype purpose) {
+    struct t_robustirc_request *request = clientp;
+    if (purpose != CURLSOCKTYPE_IPCXN) {
+        return CURL_SOCKOPT_OK;
+    }
+    const gint64 ping = (robustping_interval > 0 ? robustping_interval : robustping_interval_default);
+    gint64 rtt = robustsession_network_rtt(request->ctx->connrec->address, request->target);
+    if (rtt <= 0) {
+        rtt = 200 * 1000;
+    }
+    const int idle = (int)(CLAMP(ping / 4, G_USEC_PER_SEC, 5 * G_USEC_PER_SEC) / G_USEC_PER_SEC);
+    const int interval = (int)MAX((4 * rtt) / G_USEC_PER_SEC, 1);
+    const int count = 3;
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+    const unsigned int user_timeout = (unsigned int)(idle + interval * count) * 1000;
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+#endif
+    return CURL_SOCKOPT_OK;
+}
+
 static void get_messages(const char *target, gpointer userdata) {
     struct t_robustirc_request *request = NULL;
     struct t_robustsession_ctx *ctx = userdata;
@@ -321,12 +1492,12 @@ static void get_messages(const char *target, gpointer userdata) {
                                           ctx->sessionid);
     request->target = g_strdup(target);
     request->curl = curl;
+    session_set_target(&ctx->read_target, target);
     request->timeout_tag = g_timeout_add_seconds(
         60, get_messages_timeout, curl);
+    stream_rebalance_arm(ctx);
 
-    yajl_handle hand = yajl_alloc(&gm_callbacks, NULL, request);
-    yajl_config(hand, yajl_allow_multiple_values, 1);
-    request->parser = hand;
+    request->stream = gm_stream_new(request);
     gchar *url = g_strdup_printf(
         "https://%s%s?lastseen=%s",
         request->target,
@@ -334,9 +1505,11 @@ static void get_messages(const char *target, gpointer userdata) {
         ctx->lastseen);
     curl_easy_setopt(curl, CURLOPT_URL, url);
     g_free(url);
-    curl_set_common_options(curl, ctx, server, request);
+    curl_set_common_options(curl, ctx, server->connrec, request);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, gm_write_func);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0);
+    curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, gm_sockopt);
+    curl_easy_setopt(curl, CURLOPT_SOCKOPTDATA, request);
 
     /* Make libcurl immediately start handling the request. */
     curl_multi_add_handle(curl_handle_gm, curl);
@@ -345,6 +1518,104 @@ static void get_messages(const char *target, gpointer userdata) {
     curl_multi_socket_action(curl_handle_gm, CURL_SOCKET_TIMEOUT, 0, &running);
 }
 
+static void session_set_auth(struct t_robustsession_ctx *ctx,
+                             const char *sessionid,
+                             const char *sessionauth) {
+    ctx->sessionid = g_strdup(sessionid);
+    ctx->sessionauth = g_strdup(sessionauth);
+    ctx->headers = curl_slist_append(ctx->headers, "Accept: application/json");
+    ctx->headers = curl_slist_append(ctx->headers, "Content-Type: application/json");
+    gchar *auth = g_strdup_printf("X-Session-Auth: %s", ctx->sessionauth);
+    ctx->headers = curl_slist_append(ctx->headers, auth);
+    g_free(auth);
+}
+
+// Sends |cmd| to the new session right away, although the session is still
+// being registered (see session_replay()).
+static void replay_send(struct t_robustsession_ctx *ctx, const char *cmd) {
+    ctx->replaying = false;
+    irc_send_cmd_now(IRC_SERVER(ctx->server), cmd);
+    ctx->replaying = true;
+}
+
+static gboolean replay_nick_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    const gint64 start = robustsession_lag_enter();
+    ctx->replay_tag = 0;
+    gchar *cmd = g_strdup_printf("NICK %s", ctx->server->nick);
+    replay_send(ctx, cmd);
+    g_free(cmd);
+    robustsession_lag_leave("replay_nick_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Registers a freshly created session with the nickname irssi currently uses.
+// Once registered, replay_received() rejoins all channels, so that a
+// re-established session is indistinguishable from the lost one.
+static void session_replay(struct t_robustsession_ctx *ctx) {
+    SERVER_CONNECT_REC *conn = ctx->server->connrec;
+    gchar *cmd = NULL;
+
+    ctx->replaying = true;
+    if (conn->password != NULL && *conn->password != '\0') {
+        cmd = g_strdup_printf("PASS %s", conn->password);
+        replay_send(ctx, cmd);
+        g_free(cmd);
+    }
+    cmd = g_strdup_printf("NICK %s", ctx->server->nick);
+    replay_send(ctx, cmd);
+    g_free(cmd);
+    cmd = g_strdup_printf("USER %s 0 * :%s", conn->username, conn->realname);
+    replay_send(ctx, cmd);
+    g_free(cmd);
+}
+
+// Follows the registration which session_replay() started, based on the
+// incoming |line|.
+static void replay_received(struct t_robustsession_ctx *ctx, const char *line) {
+    if (!ctx->replaying) {
+        return;
+    }
+    if (*line == ':' && (line = strchr(line, ' ')) != NULL) {
+        line++;
+    }
+    if (line == NULL) {
+        return;
+    }
+
+    if (g_str_has_prefix(line, "433 ")) {
+        // The lost session still holds our nick until the network expires
+        // it. Registering under another nick would make the new session
+        // distinguishable, so keep asking for ours.
+        if (ctx->replay_tag == 0) {
+            ctx->replay_tag = g_timeout_add_seconds(5, replay_nick_cb, ctx);
+        }
+        return;
+    }
+
+    if (!g_str_has_prefix(line, "001 ")) {
+        return;
+    }
+    ctx->replaying = false;
+    if (ctx->replay_tag != 0) {
+        g_source_remove(ctx->replay_tag);
+        ctx->replay_tag = 0;
+    }
+    for (GSList *c = ctx->server->channels; c != NULL; c = c->next) {
+        CHANNEL_REC *channel = c->data;
+        gchar *cmd;
+        if (channel->key != NULL) {
+            cmd = g_strdup_printf("JOIN %s %s", channel->name, channel->key);
+        } else {
+            cmd = g_strdup_printf("JOIN %s", channel->name);
+        }
+        irc_send_cmd_now(IRC_SERVER(ctx->server), cmd);
+        g_free(cmd);
+    }
+    // Lines queued in the meantime need to follow the registration.
+    presession_flush(ctx);
+}
+
 static bool create_session_done(struct t_robustirc_request *request, CURL *curl) {
     yajl_val root, sessionid, sessionauth;
     char errmsg[1024];
@@ -378,21 +1649,37 @@ static bool create_session_done(struct t_robustirc_request *request, CURL *curl)
 
     curl_easy_getinfo(curl, CURLINFO_PRIMARY_IP, &ip_address);
     struct t_robustsession_ctx *ctx = request->ctx;
-    ctx->sessionid = g_strdup(YAJL_GET_STRING(sessionid));
-    ctx->sessionauth = g_strdup(YAJL_GET_STRING(sessionauth));
-    ctx->headers = curl_slist_append(ctx->headers, "Accept: application/json");
-    ctx->headers = curl_slist_append(ctx->headers, "Content-Type: application/json");
-    gchar *auth = g_strdup_printf("X-Session-Auth: %s", ctx->sessionauth);
-    ctx->headers = curl_slist_append(ctx->headers, auth);
-    g_free(auth);
+    session_set_auth(ctx, YAJL_GET_STRING(sessionid), YAJL_GET_STRING(sessionauth));
 
     // TODO: store ip somewhere
 
-    // TODO: is this necessary?
-    request->server->rawlog = rawlog_create();
+    if (transport_init_usec >= 0) {
+        gchar *init_ms = g_strdup_printf("%.1f", transport_init_usec / 1000.0);
+        gchar *session_ms = g_strdup_printf(
+            "%.1f", (g_get_monotonic_time() - ctx->connect_start) / 1000.0);
+        printformat_module(MODULE_NAME, request->server, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_FIRST_CONNECT,
+                           init_ms, session_ms);
+        g_free(init_ms);
+        g_free(session_ms);
+        // Only report the first session.
+        transport_init_usec = -1;
+    }
+
+    if (request->server->connected) {
+        // This session replaces one which was lost (see session_recover()),
+        // so irssi already considers itself connected and registered. Lines
+        // queued in the meantime are sent once the registration completed,
+        // see replay_received().
+        session_replay(ctx);
+    } else {
+        // TODO: is this necessary?
+        request->server->rawlog = rawlog_create();
 
-    request->server->connect_tag = -1;
-    server_connect_finished(SERVER(request->server));
+        presession_flush(ctx);
+        request->server->connect_tag = -1;
+        server_connect_finished(SERVER(request->server));
+    }
 
     yajl_tree_free(root);
     return true;
@@ -413,14 +1700,19 @@ static void retry_request(const char *target, gpointer userdata) {
     request->body->body = NULL;
     request->body->size = 0;
     if (request->type == RT_GETMESSAGES) {
-        yajl_free(request->parser);
-        yajl_handle hand = yajl_alloc(&gm_callbacks, NULL, request);
-        yajl_config(hand, yajl_allow_multiple_values, 1);
-        request->parser = hand;
+        gm_stream_release(request->stream);
+        request->stream = gm_stream_new(request);
     }
 
     g_free(request->target);
     request->target = g_strdup(target);
+    if (request->type == RT_GETMESSAGES) {
+        session_set_target(&request->ctx->read_target, target);
+    } else if (request->type == RT_POSTMESSAGE) {
+        session_set_target(&request->ctx->write_target, target);
+    }
+    // The round trip time of a retried request says nothing about the target.
+    request->start = 0;
 
     gchar *url = NULL;
     CURLM *multi = curl_handle;
@@ -439,12 +1731,219 @@ static void retry_request(const char *target, gpointer userdata) {
     }
     curl_easy_setopt(curl, CURLOPT_URL, url);
     g_free(url);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT,
+                     (long)(g_get_monotonic_time() < fresh_connect_until));
     curl_multi_add_handle(multi, curl);
     request->ctx->curl_handles = g_list_append(request->ctx->curl_handles, curl);
     int running;
     curl_multi_socket_action(curl_handle, CURL_SOCKET_TIMEOUT, 0, &running);
 }
 
+static gboolean session_recover_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    const gint64 start = robustsession_lag_enter();
+    ctx->recover_tag = 0;
+    robustsession_network_server(
+        ctx->connrec->address,
+        TRUE,
+        ctx->cancellable,
+        robustsession_connect_target,
+        ctx);
+    robustsession_lag_leave("session_recover_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Replaces a session which the RobustIRC network no longer knows (e.g. because
+// it expired) with a new one after a short, jittered backoff, instead of
+// disconnecting and waiting for irssi’s server_reconnect_time.
+//
+// Returns FALSE when the session cannot be recovered and the caller should
+// disconnect the server.
+static gboolean session_recover(struct t_robustsession_ctx *ctx) {
+    if (!settings_get_bool("robustirc_fast_recovery") ||
+        !ctx->server->connected ||
+        ctx->recover_attempt >= settings_get_int("robustirc_recovery_attempts")) {
+        return FALSE;
+    }
+
+    // Everything which is still in flight refers to the lost session. Lines
+    // which were not yet sent are queued for the new session, ahead of
+    // everything written in the meantime.
+    abort_requests(ctx);
+    ctx->inflight = 0;
+    ctx->burst = 0;
+    ctx->replaying = false;
+    if (ctx->replay_tag != 0) {
+        g_source_remove(ctx->replay_tag);
+        ctx->replay_tag = 0;
+    }
+    while (!g_queue_is_empty(ctx->send_queue)) {
+        g_queue_push_head(ctx->presession, g_queue_pop_tail(ctx->send_queue));
+    }
+    g_cancellable_cancel(ctx->cancellable);
+    g_object_unref(ctx->cancellable);
+    ctx->cancellable = g_cancellable_new();
+    g_cancellable_cancel(ctx->send_cancellable);
+    g_object_unref(ctx->send_cancellable);
+    ctx->send_cancellable = g_cancellable_new();
+
+    g_free(ctx->sessionid);
+    g_free(ctx->sessionauth);
+    g_free(ctx->lastseen);
+    ctx->sessionid = NULL;
+    ctx->sessionauth = NULL;
+    ctx->lastseen = g_strdup("0.0");
+    ctx->delivered_id = 0;
+    ctx->delivered_reply = 0;
+    curl_slist_free_all(ctx->headers);
+    ctx->headers = NULL;
+
+    // 250ms, 500ms, 1s, … capped at 8s, with up to 50% jitter so that all
+    // sessions of a network do not hammer it simultaneously.
+    const guint delay = 250u << MIN(ctx->recover_attempt, 5);
+    const guint jittered = delay / 2 + (guint)g_random_int_range(0, (gint32)(delay / 2) + 1);
+    ctx->recover_attempt++;
+
+    gchar *ms = g_strdup_printf("%u", jittered);
+    gchar *attempt = g_strdup_printf("%d", ctx->recover_attempt);
+    printformat_module(MODULE_NAME, ctx->server, NULL,
+                       MSGLEVEL_CRAP, ROBUSTIRCTXT_SESSION_RECOVER,
+                       ms, attempt);
+    g_free(ms);
+    g_free(attempt);
+
+    if (ctx->recover_tag != 0) {
+        g_source_remove(ctx->recover_tag);
+    }
+    ctx->recover_tag = g_timeout_add(jittered, session_recover_cb, ctx);
+    return TRUE;
+}
+
+// Bounds for the congestion window of a session, in requests.
+static const double send_window_min = 1;
+static const double send_window_max = 64;
+
+static void send_window_shrink(struct t_robustsession_ctx *ctx) {
+    const gint64 now = g_get_monotonic_time();
+    // Shrink at most once per round trip: all requests which are in flight
+    // were sent with the old window and suffer from the same congestion.
+    if (now - ctx->last_decrease < ctx->rtt_srtt) {
+        return;
+    }
+    ctx->last_decrease = now;
+    ctx->cwnd = MAX(ctx->cwnd / 2, send_window_min);
+}
+
+static void send_window_sample(struct t_robustsession_ctx *ctx, gint64 rtt) {
+    if (ctx->rtt_base == 0 || rtt < ctx->rtt_base) {
+        ctx->rtt_base = rtt;
+    } else {
+        // Let the baseline follow lasting changes, e.g. after a failover.
+        ctx->rtt_base += (rtt - ctx->rtt_base) / 64;
+    }
+    ctx->rtt_srtt = (ctx->rtt_srtt == 0 ? rtt : (7 * ctx->rtt_srtt + rtt) / 8);
+
+    // Allow for 50% (but at least 10ms) of jitter before considering the
+    // cluster congested.
+    if (rtt > ctx->rtt_base + MAX(ctx->rtt_base / 2, 10000)) {
+        send_window_shrink(ctx);
+    } else {
+        ctx->cwnd = MIN(ctx->cwnd + 1 / ctx->cwnd, send_window_max);
+    }
+}
+
+// Feeds the timings of a finished probe into the network’s latency state.
+static void probe_done(struct t_robustirc_request *request, CURLcode result) {
+    if (result != CURLE_OK) {
+        robustsession_network_probed(request->address, request->target, 0, 0, -1);
+        return;
+    }
+    double namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0;
+    curl_easy_getinfo(request->curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+    curl_easy_getinfo(request->curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(request->curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+    curl_easy_getinfo(request->curl, CURLINFO_PRETRANSFER_TIME, &pretransfer);
+    curl_easy_getinfo(request->curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+    // On a reused connection, the connect and appconnect times are 0.
+    robustsession_network_probed(
+        request->address,
+        request->target,
+        (connect > 0 ? (gint64)((connect - namelookup) * G_USEC_PER_SEC) : 0),
+        (appconnect > 0 ? (gint64)((appconnect - connect) * G_USEC_PER_SEC) : 0),
+        (gint64)((starttransfer - pretransfer) * G_USEC_PER_SEC));
+}
+
+// Sends a HEAD request to |target|, which is cheap for the server. Probes use
+// curl_handle_probe, so that they do not wait for PostMessage requests.
+static void probe_start(SERVER_CONNECT_REC *conn, const char *target) {
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return;
+    }
+    struct t_robustirc_request *request = g_new0(struct t_robustirc_request, 1);
+    request->type = RT_PROBE;
+    request->curl = curl;
+    request->body = g_new0(struct t_body_buffer, 1);
+    request->url_suffix = g_strdup("/");
+    request->target = g_strdup(target);
+    request->address = g_strdup(conn->address);
+    gchar *url = g_strdup_printf("https://%s%s", request->target, request->url_suffix);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    g_free(url);
+    curl_set_common_options(curl, NULL, conn, request);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+
+    curl_multi_add_handle(curl_handle_probe, curl);
+    probes = g_list_prepend(probes, curl);
+    int running;
+    curl_multi_socket_action(curl_handle_probe, CURL_SOCKET_TIMEOUT, 0, &running);
+}
+
+// Probes every target of every network which a session is connected to, so
+// that failover can pick the fastest target instead of the next one.
+static void probe_round(void) {
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (GList *l = sessions; l; l = l->next) {
+        struct t_robustsession_ctx *ctx = l->data;
+        if (ctx->closing || ctx->sessionid == NULL) {
+            continue;
+        }
+        gchar *key = g_ascii_strdown(ctx->connrec->address, -1);
+        if (g_hash_table_contains(seen, key)) {
+            g_free(key);
+            continue;
+        }
+        g_hash_table_add(seen, key);
+        GQueue *targets = robustsession_network_targets(ctx->connrec->address);
+        for (GList *t = (targets ? targets->head : NULL); t; t = t->next) {
+            probe_start(ctx->connrec, t->data);
+        }
+    }
+    g_hash_table_destroy(seen);
+}
+
+static void probe_schedule(void);
+
+static gboolean probe_cb(gpointer userdata) {
+    (void)userdata;
+    const gint64 start = robustsession_lag_enter();
+    probe_tag = 0;
+    // Skip this round if the previous one has not finished yet.
+    if (probes == NULL && settings_get_time("robustirc_probe_interval") > 0) {
+        probe_round();
+    }
+    probe_schedule();
+    robustsession_lag_leave("probe_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+static void probe_schedule(void) {
+    const int interval = settings_get_time("robustirc_probe_interval");
+    // When probing is disabled, check once a minute whether it was enabled.
+    probe_tag = g_timeout_add((interval > 0 ? (guint)interval : 60000), probe_cb, NULL);
+}
+
 // check_multi_info iterates through all curl handles, handling those that
 // completed by either retrying the request (on temporary errors) or freeing
 // the corresponding memory.
@@ -464,13 +1963,32 @@ static void check_multi_info(CURLM *multi) {
         // Errors on the curl higher level (e.g. connection refused) are not
         // permanent, and neither are the 5xx HTTP error codes.
         const bool temporary_error = (message->data.result != CURLE_OK ||
-                                      (http_code >= 500 && http_code < 600));
+                                      (http_code >= 500 && http_code < 600) ||
+                                      http_code == 429);
+
+        if (request->type == RT_PROBE) {
+            probe_done(request, message->data.result);
+            curl_multi_remove_handle(multi, message->easy_handle);
+            probes = g_list_remove(probes, message->easy_handle);
+            request_free(request);
+            continue;
+        }
 
         // TODO: log a line for every terminated HTTP request into the rawlog (or is there a better one?)
 
-        if (!request->server ||
-            !request->server->connrec ||
-            !request->server->connrec->address) {
+        // Closing sessions have no server anymore, but still deliver their
+        // PostMessages and DeleteSession.
+        if (!request->ctx->closing &&
+            (!request->server ||
+             !request->server->connrec ||
+             !request->server->connrec->address)) {
+            goto cleanup;
+        }
+        const char *address = request->ctx->connrec->address;
+
+        if (message->easy_handle == request->ctx->gm_draining) {
+            // Being replaced already, see session_migrate().
+            gm_break_cancel(request->ctx);
             goto cleanup;
         }
 
@@ -483,13 +2001,28 @@ static void check_multi_info(CURLM *multi) {
         // RT_GETMESSAGES requests are never-ending. If such a request
         // succeeds, the server has closed the connection, likely because the
         // server is in a network partition. Hence, treat a finished
-        // RT_GETMESSAGES like an error.
+        // RT_GETMESSAGES like an error. Only failures of the target itself
+        // (unlike e.g. an expired session) concern other irssi processes.
         if (error || request->type == RT_GETMESSAGES) {
+            const bool target_error = (message->data.result != CURLE_OK ||
+                                       (http_code >= 500 && http_code < 600) ||
+                                       !error);
             robustsession_network_failed(
-                request->server->connrec->address, request->target);
+                address, request->target, target_error);
+            if (!error && request->type == RT_GETMESSAGES &&
+                robustsession_network_stream_ended(address, request->target)) {
+                network_changed_later(address);
+            }
         } else {
             robustsession_network_succeeded(
-                request->server->connrec->address, request->target);
+                address, request->target);
+        }
+
+        if (error && temporary_error && request->type == RT_POSTMESSAGE) {
+            send_window_shrink(request->ctx);
+            if (http_code == 429) {
+                send_pace_throttled(request->ctx);
+            }
         }
 
         if ((error && temporary_error) ||
@@ -498,14 +2031,24 @@ static void check_multi_info(CURLM *multi) {
             request->ctx->curl_handles = g_list_remove(request->ctx->curl_handles, message->easy_handle);
             if (request->type == RT_GETMESSAGES) {
                 g_source_remove(request->timeout_tag);
+                request->timeout_tag = 0;
             }
 
-            robustsession_network_server(
-                request->server->connrec->address,
-                (request->type == RT_GETMESSAGES),
-                request->ctx->cancellable,
-                retry_request,
-                message->easy_handle);
+            if (request->type == RT_GETMESSAGES ||
+                request->type == RT_POSTMESSAGE) {
+                session_place(request->ctx,
+                              (request->type == RT_POSTMESSAGE),
+                              retry_request,
+                              message->easy_handle);
+            } else {
+                robustsession_network_server(
+                    address,
+                    FALSE,
+                    (request->type == RT_DELETESESSION ? request->ctx->send_cancellable
+                                                       : request->ctx->cancellable),
+                    retry_request,
+                    message->easy_handle);
+            }
             continue;
         }
 
@@ -515,6 +2058,20 @@ static void check_multi_info(CURLM *multi) {
                                MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_PERMANENT,
                                reason);
             g_free(reason);
+            if (request->ctx->closing) {
+                goto cleanup;
+            }
+            // A lost session only needs to be replaced. RobustIRC answers
+            // 404 for sessions which it does not know (anymore), e.g. because
+            // they expired. Other errors (e.g. a 400 for one malformed
+            // PostMessage) disconnect as before. session_recover() frees
+            // |request| along with all other requests of the session.
+            if (http_code == 404 &&
+                (request->type == RT_GETMESSAGES ||
+                 request->type == RT_POSTMESSAGE) &&
+                session_recover(request->ctx)) {
+                continue;
+            }
             request->server->connection_lost = TRUE;
             server_disconnect(request->server);
             continue;
@@ -527,15 +2084,16 @@ static void check_multi_info(CURLM *multi) {
         switch (request->type) {
             case RT_CREATESESSION:
                 if (create_session_done(request, message->easy_handle)) {
-                    robustsession_network_server(
-                        request->server->connrec->address,
-                        TRUE,
-                        request->ctx->cancellable,
-                        get_messages,
-                        request->ctx);
+                    session_place(request->ctx, false, get_messages, request->ctx);
                 }
                 break;
             case RT_POSTMESSAGE:
+                if (request->start != 0) {
+                    send_window_sample(request->ctx, g_get_monotonic_time() - request->start);
+                }
+                send_pace_delivered(request->ctx);
+                break;
+            case RT_DELETESESSION:
                 break;
             default:
                 assert(false);
@@ -543,21 +2101,26 @@ static void check_multi_info(CURLM *multi) {
 
     cleanup:
         curl_multi_remove_handle(multi, message->easy_handle);
-        request->ctx->curl_handles = g_list_remove(request->ctx->curl_handles, message->easy_handle);
-        curl_easy_cleanup(message->easy_handle);
-        free(request->body->body);
-        free(request->body);
-        free(request);
+        struct t_robustsession_ctx *ctx = request->ctx;
+        ctx->curl_handles = g_list_remove(ctx->curl_handles, message->easy_handle);
+        if (request->type == RT_POSTMESSAGE) {
+            ctx->inflight--;
+        } else if (request->type == RT_DELETESESSION) {
+            ctx->delete_done = true;
+        }
+        request_free(request);
+        if (ctx->closing) {
+            session_close_progress(ctx);
+        } else {
+            send_pump(ctx);
+        }
     }
 }
 
-/* irssi callback which notifies libcurl about events on file descriptor |fd|. */
-static void socket_recv_cb(void *data, GIOChannel *source, int condition) {
-    (void)condition;
-    CURLM *multi = data;
+/* Notifies libcurl about the events |ev_bitmask| on file descriptor |fd|. */
+static void socket_action(CURLM *multi, curl_socket_t fd, int ev_bitmask) {
     int running;
-    CURLMcode result = curl_multi_socket_action(
-        multi, g_io_channel_unix_get_fd(source), 0, &running);
+    CURLMcode result = curl_multi_socket_action(multi, fd, ev_bitmask, &running);
     if (result != CURLM_OK) {
         printformat_module(MODULE_NAME, NULL, NULL,
                            MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_TEMPORARY,
@@ -566,16 +2129,33 @@ static void socket_recv_cb(void *data, GIOChannel *source, int condition) {
     check_multi_info(multi);
 }
 
+/* irssi callback which notifies libcurl about events on file descriptor |fd|. */
+static void socket_recv_cb(void *data, GIOChannel *source, int condition) {
+    const gint64 start = robustsession_lag_enter();
+    int ev_bitmask = 0;
+    if (condition & I_INPUT_READ)
+        ev_bitmask |= CURL_CSELECT_IN;
+    if (condition & I_INPUT_WRITE)
+        ev_bitmask |= CURL_CSELECT_OUT;
+    socket_action(data, g_io_channel_unix_get_fd(source), ev_bitmask);
+    robustsession_lag_leave("socket_recv_cb", start);
+}
+
 struct t_timeout_ctx {
     guint *id;
     CURLM *multi;
+    // Monotonic time at which the timer is due.
+    gint64 deadline;
 };
 
 /* irssi callback which notifies libcurl about a timeout. */
 static gboolean timeout_cb(gpointer user_data) {
     struct t_timeout_ctx *ctx = user_data;
+    const gint64 start = robustsession_lag_enter();
+    robustsession_lag_dispatched(ctx->deadline);
 
     g_free(ctx->id);
+    timers[timer_index(ctx->multi)] = NULL;
     curl_multi_setopt(ctx->multi, CURLMOPT_TIMERDATA, NULL);
 
     int running;
@@ -588,6 +2168,11 @@ static gboolean timeout_cb(gpointer user_data) {
     }
     check_multi_info(ctx->multi);
     g_free(ctx);
+    // Timers are the first to fire after a resume. The check restarts
+    // requests, which re-arms the libcurl timer, so it must run only after
+    // the timer state of this (now finished) timer was cleaned up.
+    suspend_check();
+    robustsession_lag_leave("timeout_cb", start);
     return G_SOURCE_REMOVE;
 }
 
@@ -599,6 +2184,11 @@ static int _socket_callback(CURLM *multi, CURL *easy, curl_socket_t s, int what,
     if (what == CURL_POLL_NONE)
         return 0;
 
+    if (robustsession_uring_active()) {
+        curl_multi_assign(multi, s, robustsession_uring_watch(multi, s, what, socketp));
+        return 0;
+    }
+
     guint *id = socketp;
 
     if (what == CURL_POLL_REMOVE) {
@@ -642,6 +2232,10 @@ static int socket_callback_gm(CURL *easy, curl_socket_t s, int what, void *userp
     return _socket_callback(curl_handle_gm, easy, s, what, userp, socketp);
 }
 
+static int socket_callback_probe(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    return _socket_callback(curl_handle_probe, easy, s, what, userp, socketp);
+}
+
 /* libcurl callback to adjust the timeout of our glib timer. */
 static int start_timeout(CURLM *multi, long timeout_ms, void *userp) {
     guint *id = userp;
@@ -660,8 +2254,10 @@ static int start_timeout(CURLM *multi, long timeout_ms, void *userp) {
         struct t_timeout_ctx *ctx = g_new0(struct t_timeout_ctx, 1);
         ctx->id = id;
         ctx->multi = multi;
+        ctx->deadline = g_get_monotonic_time() + timeout_ms * 1000;
         *id = (guint)g_timeout_add((guint)timeout_ms, timeout_cb, ctx);
     }
+    timers[timer_index(multi)] = id;
     curl_multi_setopt(multi, CURLMOPT_TIMERDATA, id);
     return 0;
 }
@@ -690,12 +2286,53 @@ static size_t write_func(void *contents, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
-bool robustsession_init(void) {
+static gpointer ca_bundle_read(gpointer data) {
+    gchar *path = data;
+    gchar *contents = NULL;
+    g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(contents);
+    g_free(path);
+    return NULL;
+}
+
+// The TLS backend reads the CA bundle from disk during the first handshake.
+// Reading it in a separate thread while the SRV lookup is still running means
+// the handshake does not block irssi on cold disk I/O.
+static void ca_bundle_prefetch(void) {
+#if LIBCURL_VERSION_NUM >= 0x075400
+    CURL *curl = curl_easy_init();
+    char *cainfo = NULL;
+    if (!curl) {
+        return;
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_CAINFO, &cainfo) == CURLE_OK && cainfo != NULL) {
+        ca_bundle_thread = g_thread_try_new(
+            "robustirc-ca", ca_bundle_read, g_strdup(cainfo), NULL);
+    }
+    curl_easy_cleanup(curl);
+#endif
+}
+
+// Initializes libcurl when the first session is created instead of when the
+// module is loaded, so that loading the module does not delay irssi’s
+// startup when no RobustIRC network is connected right away.
+static bool transport_init(void) {
+    if (curl_handle_gm != NULL) {
+        return true;
+    }
+    const gint64 start = g_get_monotonic_time();
+
     if (curl_global_init(CURL_GLOBAL_DEFAULT) != 0)
         return false;
 
+    if (g_ascii_strcasecmp(settings_get_str("robustirc_io_backend"), "io_uring") == 0 &&
+        !robustsession_uring_init(socket_action)) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTNOTICE,
+                  "RobustIRC: falling back to the glib io backend");
+    }
+
     if (!(curl_handle = curl_multi_init()))
-        return false;
+        goto error_global;
 
     curl_multi_setopt(curl_handle, CURLMOPT_SOCKETFUNCTION, socket_callback);
     curl_multi_setopt(curl_handle, CURLMOPT_TIMERFUNCTION, start_timeout);
@@ -705,24 +2342,148 @@ bool robustsession_init(void) {
     curl_multi_setopt(curl_handle, CURLMOPT_PIPELINING, CURLPIPE_HTTP1);
 
     if (!(curl_handle_gm = curl_multi_init()))
-        return false;
+        goto error_multi;
+
+    curl_multi_setopt(curl_handle_gm, CURLMOPT_SOCKETFUNCTION, socket_callback_gm);
+    curl_multi_setopt(curl_handle_gm, CURLMOPT_TIMERFUNCTION, start_timeout);
+    /* Open at most one connection per server to not race ourselves. */
+    curl_multi_setopt(curl_handle_gm, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+
+    if (!(curl_handle_probe = curl_multi_init()))
+        goto error_multi_gm;
+
+    curl_multi_setopt(curl_handle_probe, CURLMOPT_SOCKETFUNCTION, socket_callback_probe);
+    curl_multi_setopt(curl_handle_probe, CURLMOPT_TIMERFUNCTION, start_timeout);
+
+    ca_bundle_prefetch();
+    probe_schedule();
+    gm_shards_init();
+
+    suspend_check();
+    suspend_tag = g_timeout_add_seconds(5, suspend_cb, NULL);
+
+    network_monitor = g_object_ref(g_network_monitor_get_default());
+    network_monitor_handler = g_signal_connect(
+        network_monitor, "network-changed", G_CALLBACK(network_monitor_changed), NULL);
+
+    transport_init_usec = g_get_monotonic_time() - start;
+    return true;
 
-    curl_multi_setopt(curl_handle_gm, CURLMOPT_SOCKETFUNCTION, socket_callback_gm);
-    curl_multi_setopt(curl_handle_gm, CURLMOPT_TIMERFUNCTION, start_timeout);
-    /* Open at most one connection per server to not race ourselves. */
-    curl_multi_setopt(curl_handle_gm, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+    // Unwind everything, so that the next session retries from scratch.
+error_multi_gm:
+    curl_multi_cleanup(curl_handle_gm);
+    curl_handle_gm = NULL;
+error_multi:
+    curl_multi_cleanup(curl_handle);
+    curl_handle = NULL;
+error_global:
+    robustsession_uring_deinit();
+    curl_global_cleanup();
+    return false;
+}
 
+bool robustsession_init(void) {
+    robustsession_filter_init();
     return robustsession_network_init();
 }
 
+// Delivers the outstanding PostMessage and DeleteSession requests of all
+// closing sessions in parallel, then frees all state. Gives up on whatever did
+// not complete within robustirc_shutdown_timeout.
 void robustsession_deinit(void) {
-    curl_multi_cleanup(curl_handle);
-    curl_multi_cleanup(curl_handle_gm);
+    const gint64 deadline = g_get_monotonic_time() +
+                            (gint64)settings_get_time("robustirc_shutdown_timeout") * 1000;
+    gint64 now;
+    // Requests waiting for a backoff to expire would otherwise never be sent.
+    robustsession_network_shutdown();
+    // The glib main loop no longer runs for us, so drive libcurl directly.
+    while (curl_handle != NULL && sessions != NULL &&
+           (now = g_get_monotonic_time()) < deadline) {
+        int numfds, running;
+        const int wait_ms = (int)MIN((deadline - now) / 1000 + 1, 100);
+        curl_multi_wait(curl_handle, NULL, 0, wait_ms, &numfds);
+        curl_multi_perform(curl_handle, &running);
+        check_multi_info(curl_handle);
+    }
+
+    guint undeleted = 0;
+    for (GList *l = sessions; l; l = l->next) {
+        struct t_robustsession_ctx *ctx = l->data;
+        if (!ctx->detached && ctx->sessionid != NULL && !ctx->delete_done) {
+            undeleted++;
+        }
+    }
+    if (undeleted > 0) {
+        printtext(NULL, NULL, MSGLEVEL_CLIENTERROR,
+                  "RobustIRC: %u session(s) could not be deleted within robustirc_shutdown_timeout",
+                  undeleted);
+    }
+
+    while (sessions != NULL) {
+        struct t_robustsession_ctx *ctx = sessions->data;
+        abort_requests(ctx);
+        session_free(ctx);
+    }
+
+    if (probe_tag != 0) {
+        g_source_remove(probe_tag);
+        probe_tag = 0;
+    }
+    if (network_monitor != NULL) {
+        g_signal_handler_disconnect(network_monitor, network_monitor_handler);
+        g_object_unref(network_monitor);
+        network_monitor = NULL;
+    }
+    if (network_monitor_tag != 0) {
+        g_source_remove(network_monitor_tag);
+        network_monitor_tag = 0;
+    }
+    if (suspend_tag != 0) {
+        g_source_remove(suspend_tag);
+        suspend_tag = 0;
+    }
+    gm_shards_deinit();
+
+    for (GList *l = probes; l; l = l->next) {
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(l->data, CURLINFO_PRIVATE, &request);
+        curl_multi_remove_handle(curl_handle_probe, l->data);
+        request_free(request);
+    }
+    g_list_free(probes);
+    probes = NULL;
+
+    for (size_t i = 0; i < G_N_ELEMENTS(timers); i++) {
+        if (timers[i] != NULL) {
+            g_source_remove(*timers[i]);
+            g_free(timers[i]);
+            timers[i] = NULL;
+        }
+    }
+
+    if (ca_bundle_thread != NULL) {
+        g_thread_join(ca_bundle_thread);
+        ca_bundle_thread = NULL;
+    }
+
+    if (curl_handle_gm != NULL) {
+        curl_multi_cleanup(curl_handle);
+        curl_multi_cleanup(curl_handle_gm);
+        curl_multi_cleanup(curl_handle_probe);
+        curl_global_cleanup();
+        curl_handle = curl_handle_gm = curl_handle_probe = NULL;
+    }
+    robustsession_uring_deinit();
+
+    robustsession_tap_deinit();
+    robustsession_filter_deinit();
+    robustsession_lag_deinit();
+    robustsession_network_deinit();
 }
 
 static void curl_set_common_options(CURL *curl,
                                     struct t_robustsession_ctx *ctx,
-                                    SERVER_REC *server,
+                                    SERVER_CONNECT_REC *conn,
                                     struct t_robustirc_request *request) {
     curl_easy_setopt(curl, CURLOPT_USERAGENT, ROBUSTSESSION_USER_AGENT);
     if (ctx) {
@@ -733,21 +2494,23 @@ static void curl_set_common_options(CURL *curl,
     curl_easy_setopt(curl, CURLOPT_PRIVATE, request);
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, request->curl_error_buf);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER,
-                     (int)server->connrec->tls_verify);
+                     (int)conn->tls_verify);
 
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30);
     curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT,
+                     (long)(g_get_monotonic_time() < fresh_connect_until));
 
-    if (server->connrec->family) {
+    if (conn->family) {
         long resolve = CURL_IPRESOLVE_V6;
-        if (server->connrec->family == AF_INET) {
+        if (conn->family == AF_INET) {
             resolve = CURL_IPRESOLVE_V4;
         }
         curl_easy_setopt(curl, CURLOPT_IPRESOLVE, resolve);
     }
 
     // TODO: set proxy options, see CURLOPT_PROXY and CURLOPT_PROXYUSERPWD in
-    // libcurl, see server->connrec->proxy{,_password,_port} in irssi.
+    // libcurl, see conn->proxy{,_password,_port} in irssi.
 }
 
 // Called once robustsession_network_server gave us an available server.
@@ -767,11 +2530,14 @@ static void robustsession_connect_target(const char *target,
 
     struct t_robustirc_request *request = g_new0(struct t_robustirc_request, 1);
     request->type = RT_CREATESESSION;
+    request->curl = curl;
     request->body = g_new0(struct t_body_buffer, 1);
     request->server = SERVER(server);
     request->ctx = ctx;
     request->url_suffix = g_strdup("/robustirc/v1/session");
     request->target = g_strdup(target);
+    // The session is created by |target|, so it is the first to know about it.
+    session_set_target(&ctx->write_target, target);
     gchar *url = g_strdup_printf(
         "https://%s%s",
         request->target,
@@ -779,7 +2545,7 @@ static void robustsession_connect_target(const char *target,
     curl_easy_setopt(curl, CURLOPT_URL, url);
     g_free(url);
     curl_easy_setopt(curl, CURLOPT_POST, 1);
-    curl_set_common_options(curl, ctx, SERVER(server), request);
+    curl_set_common_options(curl, ctx, server->connrec, request);
 
     /* Make libcurl immediately start handling the request. */
     curl_multi_add_handle(curl_handle, curl);
@@ -799,15 +2565,50 @@ static void robustsession_connect_resolved(
         ctx);
 }
 
+static struct t_robustsession_ctx *session_new(SERVER_REC *server) {
+    struct t_robustsession_ctx *ctx = g_new0(struct t_robustsession_ctx, 1);
+    ctx->lastseen = g_strdup("0.0");
+    ctx->server = server;
+    ctx->connrec = server->connrec;
+    server_connect_ref(ctx->connrec);
+    ctx->cancellable = g_cancellable_new();
+    ctx->send_cancellable = g_cancellable_new();
+    ctx->connect_start = g_get_monotonic_time();
+    ctx->send_queue = g_queue_new();
+    ctx->presession = g_queue_new();
+    ctx->echo_probes = g_queue_new();
+    ctx->joins = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    ctx->cwnd = 4;
+    ctx->pace_rate = MAX(settings_get_int("robustirc_send_rate"), 0);
+    sessions = g_list_prepend(sessions, ctx);
+    return ctx;
+}
+
+// Fails the connection attempt of |ctx|, so that irssi’s reconnect logic takes
+// over. Runs from the main loop, as the server is still being set up while
+// robustsession_connect() runs.
+static gboolean connect_failed_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    ctx->connect_failed_tag = 0;
+    ctx->server->connection_lost = TRUE;
+    server_connect_failed(ctx->server, "libcurl initialization failed");
+    return G_SOURCE_REMOVE;
+}
+
 struct t_robustsession_ctx *robustsession_connect(SERVER_REC *server) {
     gchar *m = g_strdup_printf("server = %p, server->connrec = %p", server, server->connrec);
     printtext(NULL, NULL, MSGLEVEL_CRAP, "looking. server = %s", m);
     g_free(m);
 
-    struct t_robustsession_ctx *ctx = g_new0(struct t_robustsession_ctx, 1);
-    ctx->lastseen = g_strdup("0.0");
-    ctx->server = server;
-    ctx->cancellable = g_cancellable_new();
+    struct t_robustsession_ctx *ctx = session_new(server);
+
+    if (!transport_init()) {
+        printformat_module(MODULE_NAME, server, NULL,
+                           MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_TEMPORARY,
+                           "libcurl initialization failed");
+        ctx->connect_failed_tag = g_idle_add(connect_failed_cb, ctx);
+        return ctx;
+    }
 
     robustsession_network_resolve(server, ctx->cancellable, robustsession_connect_resolved, ctx);
     signal_emit("server looking", 1, server);
@@ -815,56 +2616,39 @@ struct t_robustsession_ctx *robustsession_connect(SERVER_REC *server) {
     return ctx;
 }
 
-struct send_ctx {
-    SERVER_REC *server;
-    char *buffer;
-    struct t_robustsession_ctx *ctx;
-};
-
 static void robustsession_send_target(const char *target, gpointer callback) {
     struct send_ctx *send_ctx = callback;
     gchar *url = NULL;
-    yajl_gen gen = NULL;
     CURL *curl = NULL;
     struct t_robustirc_request *request = NULL;
     struct t_robustsession_ctx *ctx = send_ctx->ctx;
 
     if (!(curl = curl_easy_init())) {
-        printformat_module(MODULE_NAME, send_ctx->server, NULL,
+        printformat_module(MODULE_NAME, ctx->server, NULL,
                            MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_TEMPORARY,
                            "curl_easy_init() failed. Out of memory?");
         goto error;
     }
 
-    if (!(gen = yajl_gen_alloc(NULL))) {
-        printformat_module(MODULE_NAME, send_ctx->server, NULL,
-                           MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_TEMPORARY,
-                           "yajl_gen_alloc() failed. Out of memory?");
-        goto error;
-    }
-
-    // TODO: yajl error handling
-    yajl_gen_map_open(gen);
-    yajl_gen_string(gen, (const unsigned char *)"Data", strlen("Data"));
-    yajl_gen_string(gen, (const unsigned char *)send_ctx->buffer, strlen(send_ctx->buffer));
-    yajl_gen_string(gen, (const unsigned char *)"ClientMessageId", strlen("ClientMessageId"));
-    yajl_gen_integer(gen, g_str_hash(send_ctx->buffer) + (guint)rand());
-    yajl_gen_map_close(gen);
-    const unsigned char *body = NULL;
-    size_t len = 0;
-    yajl_gen_get_buf(gen, &body, &len);
-
     request = g_new0(struct t_robustirc_request, 1);
     request->type = RT_POSTMESSAGE;
+    request->curl = curl;
     request->body = g_new0(struct t_body_buffer, 1);
-    request->server = send_ctx->server;
+    // NULL for closing sessions, see robustsession_destroy().
+    request->server = ctx->server;
     request->target = g_strdup(target);
+    session_set_target(&ctx->write_target, target);
     request->ctx = ctx;
+    request->line = send_ctx->buffer;
+    request->msgid = send_ctx->msgid;
+    size_t len = 0;
+    request->post_body = robustsession_json_post_message(send_ctx->buffer, send_ctx->msgid, &len);
+    request->start = g_get_monotonic_time();
     request->url_suffix = g_strdup_printf("/robustirc/v1/%s/message",
                                           ctx->sessionid);
 
     if (!(url = g_strdup_printf("https://%s%s", request->target, request->url_suffix))) {
-        printformat_module(MODULE_NAME, send_ctx->server, NULL,
+        printformat_module(MODULE_NAME, ctx->server, NULL,
                            MSGLEVEL_CRAP, ROBUSTIRCTXT_ERROR_TEMPORARY,
                            "g_strdup_printf() failed. Out of memory?");
         goto error;
@@ -872,48 +2656,299 @@ static void robustsession_send_target(const char *target, gpointer callback) {
     curl_easy_setopt(curl, CURLOPT_URL, url);
     g_free(url);
     curl_easy_setopt(curl, CURLOPT_POST, 1);
-    curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, body);
-    curl_set_common_options(curl, ctx, send_ctx->server, request);
-    yajl_gen_free(gen);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request->post_body);
+    curl_set_common_options(curl, ctx, ctx->connrec, request);
 
     /* Make libcurl immediately start handling the request. */
     curl_multi_add_handle(curl_handle, curl);
     ctx->curl_handles = g_list_append(ctx->curl_handles, curl);
+    echo_probe_sent(ctx, send_ctx->buffer);
     int running;
     curl_multi_socket_action(curl_handle, CURL_SOCKET_TIMEOUT, 0, &running);
 
-    free(send_ctx->buffer);
     free(send_ctx);
     return;
 
 error:
     if (curl != NULL)
         curl_easy_cleanup(curl);
-    if (gen != NULL)
-        yajl_gen_free(gen);
     g_free(url);
     if (request != NULL) {
+        g_free(request->post_body);
         free(request->body);
+        free(request->target);
+        free(request->url_suffix);
     }
     free(request);
-    free(send_ctx->buffer);
-    free(send_ctx);
+    send_ctx_free(send_ctx);
+    ctx->inflight--;
 }
 
-void robustsession_send(struct t_robustsession_ctx *ctx, SERVER_REC *server, const char *buffer, int size_buf) {
-    (void)size_buf;
-    assert(ctx);
+// Returns the send_classes entry of |line|, or -1.
+static int send_class(const char *line) {
+    if (*line == ':') {
+        line += strcspn(line, " ");
+        line += strspn(line, " ");
+    }
+    const size_t len = strcspn(line, " \r\n");
+    if (len == 6 && g_ascii_strncasecmp(line, "NOTICE", len) == 0) {
+        const char *text = strstr(line, " :");
+        // send_classes[1] is “CTCP reply”.
+        return (text != NULL && text[2] == '\001' ? 1 : -1);
+    }
+    for (size_t i = 0; i < SEND_CLASSES; i++) {
+        if (strlen(send_classes[i].name) == len &&
+            g_ascii_strncasecmp(line, send_classes[i].name, len) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Prints how many queued lines were dropped since the last report.
+static void send_shed_report(struct t_robustsession_ctx *ctx) {
+    GString *classes = g_string_new(NULL);
+    guint total = 0;
+    for (size_t i = 0; i < SEND_CLASSES; i++) {
+        if (ctx->shed[i] == 0) {
+            continue;
+        }
+        g_string_append_printf(classes, "%s%s: %u", (total > 0 ? ", " : ""),
+                               send_classes[i].name, ctx->shed[i]);
+        total += ctx->shed[i];
+        ctx->shed[i] = 0;
+    }
+    if (total > 0 && ctx->server != NULL) {
+        gchar *count = g_strdup_printf("%u", total);
+        printformat_module(MODULE_NAME, ctx->server, NULL,
+                           MSGLEVEL_CLIENTNOTICE, ROBUSTIRCTXT_SEND_SHED,
+                           count, classes->str);
+        g_free(count);
+    }
+    g_string_free(classes, TRUE);
+}
+
+static gboolean pace_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    const gint64 start = robustsession_lag_enter();
+    ctx->pace_tag = 0;
+    send_pump(ctx);
+    robustsession_lag_leave("pace_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Returns true if another PostMessage may be started now. Otherwise, arranges
+// for send_pump() to be called once it may.
+static bool send_pace(struct t_robustsession_ctx *ctx) {
+    if (ctx->pace_rate <= 0 || ctx->closing) {
+        return true;
+    }
+    const gint64 now = g_get_monotonic_time();
+    // Allow bursts of up to one second worth of lines.
+    ctx->pace_tokens = MIN(ctx->pace_tokens + (double)(now - ctx->pace_last) * ctx->pace_rate / G_USEC_PER_SEC,
+                           MAX(ctx->pace_rate, 1));
+    ctx->pace_last = now;
+    if (ctx->pace_tokens >= 1) {
+        ctx->pace_tokens -= 1;
+        return true;
+    }
+    if (ctx->pace_tag == 0) {
+        const double wait_ms = (1 - ctx->pace_tokens) / ctx->pace_rate * 1000;
+        ctx->pace_tag = g_timeout_add((guint)wait_ms + 1, pace_cb, ctx);
+    }
+    return false;
+}
+
+// Bounds for learned pacing rates, in lines per second. Above the maximum,
+// pacing is switched off again.
+static const double pace_rate_min = 1;
+static const double pace_rate_max = 1000;
+
+// Called when the network rejected a PostMessage with HTTP 429 (Too Many
+// Requests): halves the rate at which lines were sent.
+static void send_pace_throttled(struct t_robustsession_ctx *ctx) {
+    double rate = ctx->pace_rate;
+    if (rate <= 0) {
+        // Not paced so far, so the congestion window limited the rate.
+        rate = (ctx->rtt_srtt > 0 ? ctx->cwnd * G_USEC_PER_SEC / (double)ctx->rtt_srtt : pace_rate_max);
+    }
+    ctx->pace_rate = MAX(rate / 2, pace_rate_min);
+    ctx->pace_tokens = 0;
+}
+
+// Called for every delivered PostMessage: raises a learned rate by about one
+// line per second per second, up to robustirc_send_rate (if set).
+static void send_pace_delivered(struct t_robustsession_ctx *ctx) {
+    if (ctx->pace_rate <= 0) {
+        return;
+    }
+    const int configured = settings_get_int("robustirc_send_rate");
+    ctx->pace_rate += 1 / ctx->pace_rate;
+    if (configured > 0 && ctx->pace_rate > configured) {
+        ctx->pace_rate = configured;
+    } else if (configured <= 0 && ctx->pace_rate > pace_rate_max) {
+        ctx->pace_rate = 0;
+    }
+}
+
+// Starts as many queued PostMessages as the congestion window and pacing
+// allow. Drops expired lines instead of sending them.
+static void send_pump(struct t_robustsession_ctx *ctx) {
+    // Without a session, there is nowhere to send to yet.
+    if (ctx->sessionid == NULL) {
+        return;
+    }
+    const gint64 now = g_get_monotonic_time();
+    while (!g_queue_is_empty(ctx->send_queue) &&
+           (ctx->closing || ctx->burst > 0 || ctx->inflight < (guint)ctx->cwnd)) {
+        struct send_ctx *sendctx = g_queue_peek_head(ctx->send_queue);
+        if (sendctx->deadline != 0 && sendctx->deadline < now) {
+            g_queue_pop_head(ctx->send_queue);
+            if (ctx->burst > 0) {
+                ctx->burst--;
+            }
+            ctx->shed[sendctx->class]++;
+            send_ctx_free(sendctx);
+            continue;
+        }
+        if (!send_pace(ctx)) {
+            break;
+        }
+        g_queue_pop_head(ctx->send_queue);
+        if (ctx->burst > 0) {
+            ctx->burst--;
+        }
+        ctx->inflight++;
+        if (!session_place(ctx, true, robustsession_send_target, sendctx)) {
+            ctx->inflight--;
+            send_ctx_free(sendctx);
+        }
+    }
+    send_shed_report(ctx);
+}
+
+// Smallest coalescing window worth a timer, in microseconds.
+static const gint64 coalesce_step = 1000;
+
+// Hands all lines which were coalesced so far to send_pump().
+static void coalesce_flush(struct t_robustsession_ctx *ctx) {
+    if (ctx->coalesce_tag != 0) {
+        g_source_remove(ctx->coalesce_tag);
+        ctx->coalesce_tag = 0;
+    }
+    if (ctx->coalesce_lines > 0) {
+        int bucket = 0;
+        while (bucket < COALESCE_BUCKETS - 1 && (ctx->coalesce_lines >> (bucket + 1)) > 0) {
+            bucket++;
+        }
+        coalesce_stats.batches[bucket]++;
+        coalesce_stats.flushes++;
+        coalesce_stats.window_sum += ctx->coalesce_window;
+        coalesce_stats.window_max = MAX(coalesce_stats.window_max, ctx->coalesce_window);
+        ctx->coalesce_lines = 0;
+    }
+    send_pump(ctx);
+}
+
+static gboolean coalesce_cb(gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    const gint64 start = robustsession_lag_enter();
+    ctx->coalesce_tag = 0;
+    coalesce_flush(ctx);
+    robustsession_lag_leave("coalesce_cb", start);
+    return G_SOURCE_REMOVE;
+}
+
+// Adapts the coalescing window of |ctx| to a line which was just queued.
+//
+// As long as lines arrive more slowly than the congestion window drains them,
+// the window is zero and every line is sent right away. Once lines arrive
+// faster (a script or paste bursting lines), they would queue behind the
+// congestion window anyway, so the window doubles per line up to a quarter of
+// the PostMessage RTT (and robustirc_coalesce_max), and libcurl gets the
+// lines in larger batches, which it pipelines into fewer writes. The window
+// halves again as the rate drops, and resets after an idle period.
+static void coalesce_arrival(struct t_robustsession_ctx *ctx) {
+    const gint64 now = g_get_monotonic_time();
+    const gint64 gap = now - ctx->last_arrival;
+    ctx->last_arrival = now;
+    ctx->coalesce_lines++;
+
+    const gint64 limit = MIN((gint64)settings_get_time("robustirc_coalesce_max") * 1000,
+                             ctx->rtt_srtt / 4);
+    if (ctx->closing || limit < coalesce_step || gap > ctx->rtt_srtt) {
+        ctx->send_gap = 0;
+        ctx->coalesce_window = 0;
+        return;
+    }
+    ctx->send_gap = (ctx->send_gap == 0 ? gap : (7 * ctx->send_gap + gap) / 8);
+    if (ctx->send_gap * (gint64)ctx->cwnd < ctx->rtt_srtt) {
+        ctx->coalesce_window = CLAMP(ctx->coalesce_window * 2, coalesce_step, limit);
+    } else if ((ctx->coalesce_window /= 2) < coalesce_step) {
+        ctx->coalesce_window = 0;
+    }
+}
+
+// Hands the lines which were written while there was no session to libcurl in
+// one ordered burst. The congestion window does not apply, as it knows nothing
+// about the new session yet; the lines are pipelined on one connection.
+static void presession_flush(struct t_robustsession_ctx *ctx) {
+    while (!g_queue_is_empty(ctx->presession)) {
+        g_queue_push_tail(ctx->send_queue, g_queue_pop_head(ctx->presession));
+    }
+    ctx->burst = g_queue_get_length(ctx->send_queue);
+    coalesce_flush(ctx);
+}
 
+static void send_with_id(struct t_robustsession_ctx *ctx, const char *buffer, guint msgid) {
+    // Without a session (or before its network is resolved), there is nowhere
+    // to send to yet.
+    GQueue *queue = (ctx->sessionid == NULL || ctx->restoring || ctx->replaying
+                         ? ctx->presession
+                         : ctx->send_queue);
     struct send_ctx *sendctx = g_new0(struct send_ctx, 1);
-    sendctx->server = server;
     sendctx->buffer = g_strdup(buffer);
+    sendctx->msgid = msgid;
     sendctx->ctx = ctx;
-    robustsession_network_server(
-        server->connrec->address,
-        FALSE,
-        ctx->cancellable,
-        robustsession_send_target,
-        sendctx);
+    sendctx->class = send_class(buffer);
+    if (sendctx->class != -1) {
+        const int lifetime = send_classes[sendctx->class].lifetime;
+        if (lifetime > 0) {
+            sendctx->deadline = g_get_monotonic_time() + lifetime * G_USEC_PER_SEC;
+        }
+        if (send_classes[sendctx->class].collapse) {
+            for (GList *l = queue->head; l;) {
+                GList *next = l->next;
+                struct send_ctx *queued = l->data;
+                if (queued->class == sendctx->class) {
+                    ctx->shed[queued->class]++;
+                    send_ctx_free(queued);
+                    g_queue_delete_link(queue, l);
+                }
+                l = next;
+            }
+        }
+    }
+    g_queue_push_tail(queue, sendctx);
+    if (queue == ctx->presession) {
+        return;
+    }
+    coalesce_arrival(ctx);
+    if (ctx->coalesce_window == 0) {
+        coalesce_flush(ctx);
+    } else if (ctx->coalesce_tag == 0) {
+        ctx->coalesce_tag = g_timeout_add((guint)(ctx->coalesce_window / 1000),
+                                          coalesce_cb, ctx);
+    }
+}
+
+void robustsession_send(struct t_robustsession_ctx *ctx, SERVER_REC *server, const char *buffer, int size_buf) {
+    (void)size_buf;
+    assert(ctx);
+
+    (void)server;
+    send_with_id(ctx, buffer, g_str_hash(buffer) + (guint)rand());
 }
 
 // Delivers outstanding /message requests, but never reads anything or interacts with irssi.
@@ -927,7 +2962,6 @@ void robustsession_write_only(struct t_robustsession_ctx *ctx) {
     // reference the server data which is about to be freed.
     for (GList *h = ctx->curl_handles; h;) {
         CURL *curl = h->data;
-        // TODO: refactor cleanup into a separate function
         struct t_robustirc_request *request = NULL;
         curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
         if (request->type != RT_GETMESSAGES) {
@@ -935,15 +2969,8 @@ void robustsession_write_only(struct t_robustsession_ctx *ctx) {
             h = h->next;
             continue;
         }
-        curl_multi_remove_handle(curl_handle, curl);
-        curl_easy_cleanup(curl);
-
-        g_source_remove(request->timeout_tag);
-
-        free(request->body->body);
-        free(request->body);
-        free(request->target);
-        free(request);
+        curl_multi_remove_handle(curl_handle_gm, curl);
+        request_free(request);
         GList *next = h->next;
         ctx->curl_handles = g_list_remove_link(ctx->curl_handles, h);
         g_list_free_1(h);
@@ -951,42 +2978,230 @@ void robustsession_write_only(struct t_robustsession_ctx *ctx) {
     }
 }
 
+// Called once robustsession_network_server gave us an available server.
+// Sends a DeleteSession request on behalf of a closing session.
+static void delete_session(const char *target, gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    yajl_gen gen = NULL;
+    CURL *curl = NULL;
+
+    if (!(curl = curl_easy_init()) ||
+        !(gen = yajl_gen_alloc(NULL))) {
+        if (curl != NULL)
+            curl_easy_cleanup(curl);
+        ctx->delete_done = true;
+        if (ctx->curl_handles == NULL) {
+            session_free(ctx);
+        }
+        return;
+    }
+
+    const char *quitmsg = settings_get_str("quit_message");
+    yajl_gen_map_open(gen);
+    yajl_gen_string(gen, (const unsigned char *)"Quitmessage", strlen("Quitmessage"));
+    yajl_gen_string(gen, (const unsigned char *)quitmsg, strlen(quitmsg));
+    yajl_gen_map_close(gen);
+    const unsigned char *body = NULL;
+    size_t len = 0;
+    yajl_gen_get_buf(gen, &body, &len);
+
+    struct t_robustirc_request *request = g_new0(struct t_robustirc_request, 1);
+    request->type = RT_DELETESESSION;
+    request->curl = curl;
+    request->body = g_new0(struct t_body_buffer, 1);
+    request->ctx = ctx;
+    request->url_suffix = g_strdup_printf("/robustirc/v1/%s", ctx->sessionid);
+    request->target = g_strdup(target);
+    gchar *url = g_strdup_printf(
+        "https://%s%s",
+        request->target,
+        request->url_suffix);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    g_free(url);
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+    curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, body);
+    curl_set_common_options(curl, ctx, ctx->connrec, request);
+    yajl_gen_free(gen);
+
+    curl_multi_add_handle(curl_handle, curl);
+    ctx->curl_handles = g_list_append(ctx->curl_handles, curl);
+    int running;
+    curl_multi_socket_action(curl_handle, CURL_SOCKET_TIMEOUT, 0, &running);
+}
+
+// Advances a closing session: sends its remaining lines, then DeleteSession
+// once all of them were delivered (so that the session is not deleted before
+// e.g. its QUIT made it), and frees |ctx| once nothing is left to do.
+static void session_close_progress(struct t_robustsession_ctx *ctx) {
+    send_pump(ctx);
+    // Without a session, queued lines have nowhere to go.
+    if (ctx->inflight > 0 ||
+        (ctx->sessionid != NULL && !g_queue_is_empty(ctx->send_queue))) {
+        return;
+    }
+    // After /upgrade, the session belongs to the next irssi process.
+    const bool delete = (!ctx->detached && ctx->sessionid != NULL);
+    if (delete && !ctx->delete_started) {
+        ctx->delete_started = true;
+        // delete_session() takes over from here.
+        robustsession_network_server(
+            ctx->connrec->address,
+            FALSE,
+            ctx->send_cancellable,
+            delete_session,
+            ctx);
+        return;
+    }
+    if (ctx->curl_handles == NULL && (!delete || ctx->delete_done)) {
+        session_free(ctx);
+    }
+}
+
 void robustsession_destroy(struct t_robustsession_ctx *ctx) {
     assert(ctx);
 
     printtext(NULL, NULL, MSGLEVEL_CRAP, "robustsession_destroy");
 
-    // Abort all pending robustsession_network_* operations.
+    // Abort all pending robustsession_network_* operations except for
+    // PostMessages (see send_cancellable), which are still delivered.
     g_cancellable_cancel(ctx->cancellable);
+    g_object_unref(ctx->cancellable);
+    ctx->cancellable = g_cancellable_new();
 
-    // Abort all currently running requests. This prevents any callbacks from
-    // triggering and trying to reference the server data which is about to be
-    // freed.
-    for (GList *h = ctx->curl_handles; h; h = h->next) {
+    if (ctx->recover_tag != 0) {
+        g_source_remove(ctx->recover_tag);
+        ctx->recover_tag = 0;
+    }
+    if (ctx->replay_tag != 0) {
+        g_source_remove(ctx->replay_tag);
+        ctx->replay_tag = 0;
+    }
+    ctx->replaying = false;
+    if (ctx->connect_failed_tag != 0) {
+        g_source_remove(ctx->connect_failed_tag);
+        ctx->connect_failed_tag = 0;
+    }
+    if (ctx->rebalance_tag != 0) {
+        g_source_remove(ctx->rebalance_tag);
+        ctx->rebalance_tag = 0;
+    }
+
+    // Abort all currently running requests except for PostMessages, which
+    // are still delivered. Setting the server pointer to NULL prevents any
+    // callbacks from triggering and trying to reference the server data which
+    // is about to be freed.
+    for (GList *h = ctx->curl_handles; h;) {
         CURL *curl = h->data;
-        // TODO: refactor cleanup into a separate function
         struct t_robustirc_request *request = NULL;
         curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
-        curl_multi_remove_handle(curl_handle, curl);
-        curl_easy_cleanup(curl);
-
-        if (request->type == RT_GETMESSAGES) {
-            g_source_remove(request->timeout_tag);
+        GList *next = h->next;
+        if (request->type == RT_POSTMESSAGE) {
+            request->server = NULL;
+        } else {
+            curl_multi_remove_handle(request_multi(request), curl);
+            request_free(request);
+            ctx->curl_handles = g_list_delete_link(ctx->curl_handles, h);
         }
-
-        free(request->body->body);
-        free(request->body);
-        free(request->target);
-        free(request);
+        h = next;
     }
+    gm_break_cancel(ctx);
+    ctx->server = NULL;
+    ctx->closing = true;
 
-    g_list_free(ctx->curl_handles);
-
-    g_free(ctx);
-
-    // TODO: send destroysession request, possibly only on a best-effort basis to avoid big refactoring.
+    // Closing sessions send everything which is still queued at once.
+    coalesce_flush(ctx);
+    session_close_progress(ctx);
 
     // TODO: free the _network entry if there are no other open connections to
     // that same network so that we’ll re-resolve the next time we connect.
     // maybe use refcounting for that? does that play nice with a hashtable?
 }
+
+// Stores everything the next irssi process needs to resume |ctx| into the
+// /upgrade session |node|. Afterwards, the RobustIRC session belongs to the
+// next irssi process and |ctx| must only be destroyed.
+void robustsession_save(struct t_robustsession_ctx *ctx, CONFIG_REC *config, CONFIG_NODE *node) {
+    assert(ctx);
+
+    if (ctx->sessionid == NULL) {
+        // CreateSession did not complete yet, the next irssi process will
+        // start from scratch.
+        return;
+    }
+
+    config_node_set_str(config, node, "robustirc_sessionid", ctx->sessionid);
+    config_node_set_str(config, node, "robustirc_sessionauth", ctx->sessionauth);
+    config_node_set_str(config, node, "robustirc_lastseen", ctx->lastseen);
+
+    // Messages which are still in flight are re-sent with the same
+    // ClientMessageId, so the server discards them if they already made it.
+    GString *pending = g_string_new(NULL);
+    for (GList *h = ctx->curl_handles; h; h = h->next) {
+        struct t_robustirc_request *request = NULL;
+        curl_easy_getinfo(h->data, CURLINFO_PRIVATE, &request);
+        if (request->type != RT_POSTMESSAGE) {
+            continue;
+        }
+        gchar *line = g_strchomp(g_strdup(request->line));
+        g_string_append_printf(pending, "%u %s\n", request->msgid, line);
+        g_free(line);
+    }
+    GQueue *queues[] = {ctx->send_queue, ctx->presession};
+    for (size_t i = 0; i < G_N_ELEMENTS(queues); i++) {
+        for (GList *l = queues[i]->head; l; l = l->next) {
+            struct send_ctx *send_ctx = l->data;
+            gchar *line = g_strchomp(g_strdup(send_ctx->buffer));
+            g_string_append_printf(pending, "%u %s\n", send_ctx->msgid, line);
+            g_free(line);
+        }
+    }
+    config_node_set_str(config, node, "robustirc_pending", pending->str);
+    g_string_free(pending, TRUE);
+
+    ctx->detached = true;
+}
+
+static void robustsession_restore_resolved(
+    SERVER_REC *server, gpointer userdata) {
+    struct t_robustsession_ctx *ctx = userdata;
+    (void)server;
+    ctx->restoring = false;
+    session_place(ctx, false, get_messages, ctx);
+
+    // Lines which were in flight in the previous irssi process go first,
+    // followed by everything written since.
+    for (gchar **p = ctx->restored_pending; p && *p; p++) {
+        gchar *line = NULL;
+        const guint64 msgid = g_ascii_strtoull(*p, &line, 10);
+        if (line == *p || *line != ' ') {
+            continue;
+        }
+        send_with_id(ctx, line + 1, (guint)msgid);
+    }
+    g_strfreev(ctx->restored_pending);
+    ctx->restored_pending = NULL;
+    presession_flush(ctx);
+}
+
+// Resumes the session which the previous irssi process stored in |node| using
+// robustsession_save(). Returns NULL if |node| does not contain a session.
+struct t_robustsession_ctx *robustsession_restore(SERVER_REC *server, CONFIG_NODE *node) {
+    const char *sessionid = config_node_get_str(node, "robustirc_sessionid", NULL);
+    const char *sessionauth = config_node_get_str(node, "robustirc_sessionauth", NULL);
+    const char *lastseen = config_node_get_str(node, "robustirc_lastseen", NULL);
+    if (sessionid == NULL || sessionauth == NULL || lastseen == NULL ||
+        !transport_init()) {
+        return NULL;
+    }
+
+    struct t_robustsession_ctx *ctx = session_new(server);
+    session_set_auth(ctx, sessionid, sessionauth);
+    ctx->restoring = true;
+    g_free(ctx->lastseen);
+    ctx->lastseen = g_strdup(lastseen);
+    ctx->restored_pending = g_strsplit(
+        config_node_get_str(node, "robustirc_pending", ""), "\n", -1);
+
+    robustsession_network_resolve(server, ctx->cancellable, robustsession_restore_resolved, ctx);
+    return ctx;
+}
@@ -10,3 +10,8 @@ struct t_robustsession_ctx *robustsession_connect(SERVER_REC *server);
 void robustsession_send(struct t_robustsession_ctx *ctx, SERVER_REC *server, const char *buffer, int size_buf);
 void robustsession_write_only(struct t_robustsession_ctx *ctx);
 void robustsession_destroy(struct t_robustsession_ctx *ctx);
+void robustsession_save(struct t_robustsession_ctx *ctx, CONFIG_REC *config, CONFIG_NODE *node);
+struct t_robustsession_ctx *robustsession_restore(SERVER_REC *server, CONFIG_NODE *node);
+void robustsession_print_stats(void);
+void robustsession_drain(const char *address, const char *target, bool drain);
+void robustsession_pin(const char *address, const char *target);
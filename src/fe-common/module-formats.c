@@ -15,5 +15,30 @@ FORMAT_REC fe_robustirc_formats[] = {
     {"error_parse_json", "{hilight RobustIRC:} Error parsing chunk \"$0\" as JSON {reason $1}", 2, {0}},
     {"error_permanent", "{hilight RobustIRC:} Permanent error (killed?) {reason $0}", 1, {0}},
 
+    {NULL, "Sessions", 0, {0}},
+
+    {"first_connect", "{hilight RobustIRC:} Transport initialized in $0 ms, first session created in $1 ms", 2, {0}},
+    {"session_recover", "{hilight RobustIRC:} Session lost, re-establishing in $0 ms (attempt $1)", 2, {0}},
+    {"session_joined", "{hilight RobustIRC:} Registered and joined all channels $0 ms after connecting", 1, {0}},
+    {"resumed", "{hilight RobustIRC:} Resumed after $0 s of suspend, restarting all sessions", 1, {0}},
+    {"send_shed", "{hilight RobustIRC:} Dropped $0 outdated lines from the send queue ($1)", 2, {0}},
+
+    {NULL, "Statistics", 0, {0}},
+
+    {"stats_echo", "{hilight RobustIRC:} Echo latency with placement $0: $1 samples, avg $2 ms, max $3 ms", 4, {0}},
+    {"stats_coalesce", "{hilight RobustIRC:} Coalescing: $0 batches, avg window $1 ms, max window $2 ms, batch sizes$3", 4, {0}},
+    {"stats_target", "{hilight RobustIRC:} $0 {server $1}: RTT $2 ms, connect $3 ms, TLS $4 ms, $5 failed probes", 6, {0}},
+    {"stats_filter", "{hilight RobustIRC:} Filter rule \"$0\" dropped $1 and hid $2 messages", 3, {0}},
+    {"stats_lag", "{hilight RobustIRC:} $0: $1 calls, avg $2 ms, max $3 ms, histogram$4", 5, {0}},
+
+    {NULL, "Targets", 0, {0}},
+
+    {"target_state", "{hilight RobustIRC:} $0 {server $1} is now $2", 3, {0}},
+    {"target_unknown", "{hilight RobustIRC:} Unknown network $0 or target {server $1}", 2, {0}},
+
+    {NULL, "Performance", 0, {0}},
+
+    {"lag_warning", "{hilight RobustIRC:} $0 blocked irssi for $1 ms ($2 more times since the last warning)", 3, {0}},
+
     {NULL, NULL, 0, {0}},
 };
@@ -9,6 +9,23 @@ enum {
     ROBUSTIRCTXT_ERROR_RETRY,
     ROBUSTIRCTXT_ERROR_PARSE_JSON,
     ROBUSTIRCTXT_ERROR_PERMANENT,
+    ROBUSTIRCTXT_FILL_2,
+    ROBUSTIRCTXT_FIRST_CONNECT,
+    ROBUSTIRCTXT_SESSION_RECOVER,
+    ROBUSTIRCTXT_SESSION_JOINED,
+    ROBUSTIRCTXT_RESUMED,
+    ROBUSTIRCTXT_SEND_SHED,
+    ROBUSTIRCTXT_FILL_3,
+    ROBUSTIRCTXT_STATS_ECHO,
+    ROBUSTIRCTXT_STATS_COALESCE,
+    ROBUSTIRCTXT_STATS_TARGET,
+    ROBUSTIRCTXT_STATS_FILTER,
+    ROBUSTIRCTXT_STATS_LAG,
+    ROBUSTIRCTXT_FILL_4,
+    ROBUSTIRCTXT_TARGET_STATE,
+    ROBUSTIRCTXT_TARGET_UNKNOWN,
+    ROBUSTIRCTXT_FILL_5,
+    ROBUSTIRCTXT_LAG_WARNING,
 };
 
 extern FORMAT_REC fe_robustirc_formats[];